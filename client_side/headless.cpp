@@ -0,0 +1,201 @@
+/*
+ * Headless (scripted) client mode implementation
+ */
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <format>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+#include "../common/connection.h"
+#include "headless.h"
+#include "messages.pb.h"
+
+
+// Command to measure round-trip time, the server replies with single result
+#define PROBE_COMMAND       "ping"
+// Time to wait for outstanding command results, after the input is over
+#define RESULT_DRAIN_TIMEOUT    std::chrono::seconds(5)
+
+using Clock = std::chrono::steady_clock;
+
+// Statistics, collected by the receiver thread
+struct ReceiveStats {
+    std::mutex mutex;
+    std::condition_variable cond;
+    // Send time of the commands, waiting for result (server keeps the order)
+    std::deque<Clock::time_point> pending;
+    std::vector<Clock::duration> round_trips;
+    size_t chats = 0;
+    size_t results = 0;
+    size_t bytes = 0;
+    bool closed = false;
+};
+
+void input_to_message(const std::string &input, PBMessage &message) {
+    if (input.starts_with('!')) {
+        // This is a commmand, split into command and parameter(s)
+        std::stringstream ss(input.substr(1));
+        std::string token;
+        getline(ss, token, ' ');
+        message.mutable_command()->set_command(token);
+        if (getline(ss, token)) {
+            message.mutable_command()->set_parameter(token);
+        }
+    }
+    else {
+        // This is plain text message
+        message.mutable_chat()->set_text(input);
+    }
+}
+
+// Consume server responses, no console output
+static void receiver_loop(Connection &server, ReceiveStats &stats) {
+    PBMessage message;
+    while (server.recv_protobuf(message)) {
+        auto now = Clock::now();
+
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        stats.bytes += sizeof(uint32_t) + message.ByteSizeLong();
+        if (message.has_chat()) {
+            stats.chats++;
+        }
+        else if (message.has_result()) {
+            stats.results++;
+            // Streamed results are completed by the frame without "more" flag
+            if (!message.result().more() && !stats.pending.empty()) {
+                stats.round_trips.push_back(now - stats.pending.front());
+                stats.pending.pop_front();
+                stats.cond.notify_all();
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.closed = true;
+    stats.cond.notify_all();
+}
+
+static void print_stats(size_t messages, size_t probes, size_t bytes,
+        Clock::duration elapsed, ReceiveStats &stats) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    std::cout << std::format("Sent: {} messages (+{} probes), {} bytes in {:.3f} s, "
+            "{:.0f} msg/s, {:.2f} MB/s", messages, probes, bytes, seconds,
+            messages / seconds, bytes / seconds / 1e6) << std::endl;
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    std::cout << std::format("Received: {} chats, {} results, {} bytes",
+            stats.chats, stats.results, stats.bytes) << std::endl;
+    if (stats.pending.size()) {
+        std::cout << std::format("Unanswered commands: {}", stats.pending.size()) << std::endl;
+    }
+
+    auto &rtt = stats.round_trips;
+    if (rtt.empty()) {
+        return;
+    }
+    std::sort(rtt.begin(), rtt.end());
+    auto usec = [](Clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    Clock::duration total{0};
+    for (auto d: rtt) {
+        total += d;
+    }
+    std::cout << std::format("Round-trip ({} samples): min {:.0f}, avg {:.0f}, p50 {:.0f}, "
+            "p99 {:.0f}, max {:.0f} usec", rtt.size(), usec(rtt.front()),
+            usec(total / rtt.size()), usec(rtt[rtt.size() / 2]),
+            usec(rtt[std::min(rtt.size() - 1, rtt.size() * 99 / 100)]),
+            usec(rtt.back())) << std::endl;
+}
+
+int headless_loop(Connection &server, std::istream &input, const HeadlessOptions &options) {
+    ReceiveStats stats;
+    std::thread receiver(receiver_loop, std::ref(server), std::ref(stats));
+
+    PBMessage probe;
+    probe.mutable_command()->set_command(PROBE_COMMAND);
+
+    std::chrono::duration<double> interval(options.rate > 0 ? 1 / options.rate : 0);
+    size_t sent_messages = 0, sent_probes = 0, sent_bytes = 0;
+    bool send_failed = false;
+    bool input_over = false;
+    std::string buffer, line;
+    auto start = Clock::now();
+
+    while (!input_over && !send_failed) {
+        // Collect the messages which are due (all of them, when rate is unlimited)
+        buffer.clear();
+        size_t batch_commands = 0;
+        for (size_t n = 0; n < std::max<size_t>(options.batch, 1); n++) {
+            if (options.rate > 0) {
+                auto due = start + std::chrono::duration_cast<Clock::duration>(interval * sent_messages);
+                if (Clock::now() < due) {
+                    if (n > 0) {
+                        break;  // Send what we have, then wait
+                    }
+                    std::this_thread::sleep_until(due);
+                }
+            }
+
+            if (!std::getline(input, line)) {
+                input_over = true;
+                break;
+            }
+            if (line.empty()) {
+                continue;
+            }
+
+            PBMessage message;
+            input_to_message(line, message);
+            Connection::append_frame(buffer, message);
+            sent_messages++;
+            if (message.has_command()) {
+                batch_commands++;
+            }
+
+            if (options.probe_every && sent_messages % options.probe_every == 0) {
+                Connection::append_frame(buffer, probe);
+                sent_probes++;
+                batch_commands++;
+            }
+        }
+        if (buffer.empty()) {
+            continue;
+        }
+
+        {
+            // Register the commands before sending, the result may arrive immediately
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            stats.pending.insert(stats.pending.end(), batch_commands, Clock::now());
+        }
+        if (!server.send_frames(buffer)) {
+            std::cerr << "Send failed after " << sent_messages << " messages" << std::endl;
+            send_failed = true;
+        }
+        sent_bytes += buffer.size();
+    }
+    auto elapsed = Clock::now() - start;
+
+    {
+        // Let the outstanding command results arrive
+        std::unique_lock<std::mutex> lock(stats.mutex);
+        stats.cond.wait_for(lock, RESULT_DRAIN_TIMEOUT, [&stats] {
+            return stats.pending.empty() || stats.closed;
+        });
+    }
+    server.force_shutdown();
+    receiver.join();
+
+    print_stats(sent_messages, sent_probes, sent_bytes, elapsed, stats);
+    return send_failed ? 1 : 0;
+}
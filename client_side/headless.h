@@ -0,0 +1,22 @@
+/*
+ * Headless (scripted) client mode declaration
+ */
+
+
+class Connection;
+class PBMessage;
+
+struct HeadlessOptions {
+    // Messages per second to send, zero means as fast as possible
+    double rate = 0;
+    // Max number of messages pipelined in a single send() call
+    size_t batch = 64;
+    // Insert a !ping round-trip probe after each N messages, zero to disable
+    size_t probe_every = 100;
+};
+
+// Convert a console/script line to a chat or command message
+void input_to_message(const std::string &input, PBMessage &message);
+
+// Send all lines from input, consume responses and print statistics
+int headless_loop(Connection &server, std::istream &input, const HeadlessOptions &options);
@@ -1,30 +1,37 @@
 #include <sstream>
 #include <iomanip>
 #include <format>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <charconv>
+#include <cstring>
 
 #include "../common/defines.h"
 #include "../common/connection.h"
+#include "../common/shm_ring.h"
+#include "headless.h"
 #include "messages.pb.h"
 
 
+// Reconnect attempts after connection loss, with increasing delay
+#define RECONNECT_ATTEMPTS  5
+
+// Login state, to resume the session after connection loss
+struct Session {
+    std::string server_host;
+    std::string user_name;
+    std::string resume_token;
+    uint64_t last_seq = 0;
+};
+
 // Send protobuffer message (command or chat) based on input string
 static bool process_input(Connection &server, const std::string &input) {
-    std::string buffer;
     PBMessage message;
-    if (input.starts_with('!')) {
-        // This is a commmand, split into command and parameter(s)
-        std::stringstream ss(input.substr(1));
-        std::string token;
-        getline(ss, token, ' ');
-        message.mutable_command()->set_command(token);
-        if (getline(ss, token)) {;
-            message.mutable_command()->set_parameter(token);
-        }
-    }
-    else {
-        // This is plain text message
-        message.mutable_chat()->set_text(input);
-    }
+    input_to_message(input, message);
 
     // Send the data to socket
     return server.send_protobuf(message);
@@ -37,23 +44,35 @@ std::string format_chat_message(const PBChatMessage &chat) {
     std::tm* local_tm = std::localtime(&raw_time);
 
     std::ostringstream oss;
-    oss << std::put_time(local_tm, "%Y-%m-%d %H:%M:%S ") << chat.from_user() << ":" << std::endl;
+    oss << std::put_time(local_tm, "%Y-%m-%d %H:%M:%S ") << chat.from_user()
+            << (chat.to_user().size() ? " (direct)" : "") << ":" << std::endl;
     oss << " " << chat.text() << std::endl;
     return oss.str();
 }
 
 // Run client loop
-int client_loop(Connection &server, const std::string &user_name) {
+int client_loop(Connection &server, Session &session, bool &connection_lost) {
     bool had_recv, had_stdin;
+    connection_lost = false;
     while (server.wait_recv_or_stdin(had_recv, had_stdin)) {
         if (had_recv) {
             // Receive message from socket
             PBMessage message;
             if (!server.recv_protobuf(message)) {
+                // Not closed by the server: network problem, try to resume
+                connection_lost = !server.is_peer_closed() && session.resume_token.size();
                 break;
             }
 
-            if (message.has_chat()) {
+            if (message.has_login()) {
+                // Login reply, a new session starts from the current sequence
+                if (message.login().resume_token() != session.resume_token) {
+                    session.resume_token = message.login().resume_token();
+                    session.last_seq = message.login().last_seq();
+                }
+            }
+            else if (message.has_chat()) {
+                session.last_seq = std::max(session.last_seq, message.chat().seq());
                 // Send the chat info and text to console
                 std::cout << format_chat_message(message.chat());
             }
@@ -88,11 +107,94 @@ int client_loop(Connection &server, const std::string &user_name) {
     return 0;
 }
 
+// Connect and send the user-login (resumes the session, when there is a token)
+static std::unique_ptr<Connection> connect_and_login(const Session &session) {
+    int socket_fd = session.server_host.starts_with("unix:") ?
+            connect_to_unix_server(session.server_host.substr(5)) :
+            connect_to_server(session.server_host, SERVER_PORT);
+    if (socket_fd < 0) {
+        return nullptr;
+    }
+    auto server = std::make_unique<Connection>(socket_fd);
+
+    PBMessage message;
+    message.mutable_login()->set_user_name(session.user_name);
+    if (session.resume_token.size()) {
+        message.mutable_login()->set_resume_token(session.resume_token);
+        message.mutable_login()->set_last_seq(session.last_seq);
+    }
+    if (!server->send_protobuf(message)) {
+        return nullptr;
+    }
+    return server;
+}
+
+// Read broadcast messages from the server shared memory ring (local only)
+int shm_consumer_loop(const std::string &name) {
+    ShmRing ring;
+    if (!ring.open(name)) {
+        return 1;
+    }
+
+    std::string data;
+    PBMessage message;
+    while (!ring.is_closed()) {
+        int res = ring.read(data);
+        if (res == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        else if (res < 0) {
+            std::cerr << "Some messages were lost (consumer is too slow)" << std::endl;
+        }
+        else if (message.ParseFromString(data) && message.has_chat()) {
+            std::cout << format_chat_message(message.chat());
+        }
+    }
+    std::cout << "Server closed the ring" << std::endl;
+    return 0;
+}
+
+// Whole argument as a number, false for any other text or out of range
+template <typename T>
+static bool parse_number(const char *text, T &number) {
+    const char *end = text + strlen(text);
+    auto [ptr, error] = std::from_chars(text, end, number);
+    return error == std::errc() && ptr == end && ptr != text;
+}
+
 int main(int argc, char **argv) {
     std::cout << "Chat client application" << std::endl;
 
-    if (argc != 3) {
-        std::cerr << std::format("Usage:\n{} <server> <user>", argv[0]) << std::endl;
+    // Optional headless mode arguments
+    std::string script;
+    HeadlessOptions options;
+    bool args_ok = argc >= 3;
+    for (int i = 3; args_ok && i < argc; i++) {
+        std::string arg(argv[i]);
+        if (i + 1 >= argc) {
+            args_ok = false;
+        }
+        else if (arg == "--script") {
+            script = argv[++i];
+        }
+        else if (arg == "--rate") {
+            args_ok = parse_number(argv[++i], options.rate);
+        }
+        else if (arg == "--batch") {
+            args_ok = parse_number(argv[++i], options.batch);
+        }
+        else if (arg == "--probe") {
+            args_ok = parse_number(argv[++i], options.probe_every);
+        }
+        else {
+            args_ok = false;
+        }
+    }
+
+    if (!args_ok) {
+        std::cerr << std::format("Usage:\n{} <server|unix:<path>|shm:<name>> <user> "
+                "[--script <file|-> [--rate <msg/s>] [--batch <count>] [--probe <count>]]",
+                argv[0]) << std::endl;
         return 255;
     }
     std::string server_host(argv[1]);
@@ -100,19 +202,47 @@ int main(int argc, char **argv) {
 
     std::cout << std::format("Connecting chat client to {} as user {}", server_host, user_name) << std::endl;
 
-    int socket_fd = connect_to_server(server_host, SERVER_PORT);
-    if (socket_fd < 0) {
-        return socket_fd;
+    if (server_host.starts_with("shm:")) {
+        // Receive-only, no login
+        return shm_consumer_loop(server_host.substr(4));
     }
-    Connection server(socket_fd);
 
-    // First send the user-login
-    PBMessage message;
-    message.mutable_login()->set_user_name(user_name);
-    if (!server.send_protobuf(message)) {
+    Session session{server_host, user_name};
+    auto server = connect_and_login(session);
+    if (server == nullptr) {
         return 1;
     }
 
     // Then run loop
-    return client_loop(server, user_name);
+    if (script.size()) {
+        // Headless mode: send script lines from file or stdin ("-")
+        if (script == "-") {
+            return headless_loop(*server, std::cin, options);
+        }
+        std::ifstream input(script);
+        if (!input) {
+            std::cerr << "Can't open script file " << script << std::endl;
+            return 1;
+        }
+        return headless_loop(*server, input, options);
+    }
+
+    while (true) {
+        bool connection_lost;
+        int ret = client_loop(*server, session, connection_lost);
+        if (!connection_lost) {
+            return ret;
+        }
+
+        // Resume the session, the server replays the missed messages
+        server.reset();
+        for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS && server == nullptr; attempt++) {
+            std::cout << std::format("Connection lost, reconnecting (attempt {})...", attempt) << std::endl;
+            std::this_thread::sleep_for(std::chrono::seconds(attempt));
+            server = connect_and_login(session);
+        }
+        if (server == nullptr) {
+            return 1;
+        }
+    }
 }
@@ -0,0 +1,102 @@
+/*
+ * BufferPool class implementation
+ */
+#include <string>
+#include <format>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <vector>
+#include <bit>
+
+#include "buffer_pool.h"
+#include "defines.h"
+
+
+BufferPool::BufferPool(size_t max_cached_bytes) : m_max_cached_bytes(max_cached_bytes) {
+}
+
+BufferPool::~BufferPool() {
+    for (auto &size_class: m_classes) {
+        for (auto data: size_class.free) {
+            delete[] data;
+        }
+    }
+}
+
+BufferPool &BufferPool::instance() {
+    // Function static singleton for lazy initialization
+    static BufferPool pool(BUFFER_POOL_MAX_CACHED);
+    return pool;
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size) {
+    size_t shift = std::max<size_t>(std::bit_width(size ? size - 1 : 0), MIN_SIZE_SHIFT);
+    size_t idx = shift - MIN_SIZE_SHIFT;
+    if (idx >= CLASS_COUNT) {
+        // Too large to be kept
+        return Buffer(new char[size], size);
+    }
+
+    size_t capacity = size_t(1) << shift;
+    auto &size_class = m_classes[idx];
+    {
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        size_class.in_use++;
+        if (size_class.free.size()) {
+            char *data = size_class.free.back();
+            size_class.free.pop_back();
+            return Buffer(data, capacity);
+        }
+    }
+    return Buffer(new char[capacity], capacity);
+}
+
+void BufferPool::release(char *data, size_t capacity) {
+    size_t idx = std::bit_width(capacity - 1) - MIN_SIZE_SHIFT;
+    if (!std::has_single_bit(capacity) || idx >= CLASS_COUNT) {
+        delete[] data;
+        return;
+    }
+
+    auto &size_class = m_classes[idx];
+    {
+        std::lock_guard<std::mutex> lock(size_class.mutex);
+        size_class.in_use--;
+        if ((size_class.free.size() + 1) * capacity <= m_max_cached_bytes) {
+            size_class.free.push_back(data);
+            return;
+        }
+    }
+    delete[] data;
+}
+
+size_t BufferPool::get_in_use_bytes() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < CLASS_COUNT; i++) {
+        std::lock_guard<std::mutex> lock(m_classes[i].mutex);
+        bytes += m_classes[i].in_use << (i + MIN_SIZE_SHIFT);
+    }
+    return bytes;
+}
+
+size_t BufferPool::get_cached_bytes() {
+    size_t bytes = 0;
+    for (size_t i = 0; i < CLASS_COUNT; i++) {
+        std::lock_guard<std::mutex> lock(m_classes[i].mutex);
+        bytes += m_classes[i].free.size() << (i + MIN_SIZE_SHIFT);
+    }
+    return bytes;
+}
+
+std::vector<std::string> BufferPool::get_report() {
+    std::vector<std::string> report;
+    for (size_t i = 0; i < CLASS_COUNT; i++) {
+        std::lock_guard<std::mutex> lock(m_classes[i].mutex);
+        if (m_classes[i].in_use || m_classes[i].free.size()) {
+            report.push_back(std::format("  {} B buffers: {} in use, {} cached",
+                    size_t(1) << (i + MIN_SIZE_SHIFT), m_classes[i].in_use, m_classes[i].free.size()));
+        }
+    }
+    return report;
+}
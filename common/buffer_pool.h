@@ -0,0 +1,63 @@
+/*
+ * BufferPool class declaration
+ */
+
+// Recycled I/O buffers in power-of-two size classes (slab style), to avoid
+// a heap allocation per message. Connections hold buffers only while a
+// message is being sent or received, idle ones hold none.
+class BufferPool {
+    static constexpr size_t MIN_SIZE_SHIFT = 8;     // 256 bytes
+    static constexpr size_t CLASS_COUNT = 13;       // up to 1 MB, larger are not pooled
+
+    struct SizeClass {
+        std::mutex mutex;
+        std::vector<char*> free;
+        size_t in_use = 0;
+    };
+    std::array<SizeClass, CLASS_COUNT> m_classes;
+    // Free buffers above this are returned to the heap (per size class)
+    std::atomic<size_t> m_max_cached_bytes;
+
+    BufferPool(size_t max_cached_bytes);
+
+    void release(char *data, size_t capacity);
+
+public:
+    // Buffer handle, returns the memory to the pool when destroyed
+    class Buffer {
+        friend class BufferPool;
+        char *m_data = nullptr;
+        size_t m_capacity = 0;
+
+        Buffer(char *data, size_t capacity) : m_data(data), m_capacity(capacity) {}
+
+    public:
+        Buffer() {}
+        Buffer(Buffer &&other) : m_data(other.m_data), m_capacity(other.m_capacity) {
+            other.m_data = nullptr;
+        }
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+        ~Buffer() {
+            if (m_data) {
+                BufferPool::instance().release(m_data, m_capacity);
+            }
+        }
+
+        char *data() const { return m_data;}
+        size_t capacity() const { return m_capacity;}
+    };
+
+    ~BufferPool();
+
+    static BufferPool &instance();
+
+    Buffer acquire(size_t size);
+    // Surplus free buffers are released on their next return
+    void set_max_cached_bytes(size_t bytes) { m_max_cached_bytes = bytes;}
+
+    // Bytes in buffers, currently used and cached for reuse
+    size_t get_in_use_bytes();
+    size_t get_cached_bytes();
+    std::vector<std::string> get_report();
+};
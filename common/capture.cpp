@@ -0,0 +1,129 @@
+/*
+ * Traffic capture file implementation
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+
+#include "capture.h"
+
+
+#define CAPTURE_MAGIC           "CHATCAP1"
+// Buffered records are written at least this often (and on connection close)
+#define CAPTURE_FLUSH_INTERVAL  std::chrono::milliseconds(100)
+// Longer frame length is a damaged file, not allocated
+#define CAPTURE_MAX_FRAME       (16 << 20)
+
+static void append_varint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back(static_cast<char>(value));
+}
+
+static bool read_varint(std::istream &input, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if (byte == EOF) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+CaptureWriter::CaptureWriter() {
+}
+
+CaptureWriter::~CaptureWriter() {
+}
+
+CaptureWriter &CaptureWriter::instance() {
+    // Function static singleton for lazy initialization
+    static CaptureWriter writer;
+    return writer;
+}
+
+bool CaptureWriter::open(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_file.open(path, std::ios::binary | std::ios::trunc);
+    if (!m_file) {
+        std::cerr << "Can't create capture file " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    m_file.write(CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    m_start = std::chrono::steady_clock::now();
+    m_last_flush = m_start;
+    m_is_open = true;
+    return true;
+}
+
+void CaptureWriter::write(uint32_t connection_id, CaptureType type, const char *frame, size_t len) {
+    std::string record;
+    append_varint(record, connection_id);
+    record.push_back(static_cast<char>(type));
+    if (type == CAPTURE_FRAME) {
+        append_varint(record, len);
+    }
+
+    // The time is taken under the lock, so it never goes back
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = std::chrono::steady_clock::now();
+    uint64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(now - m_start).count();
+    std::string delta;
+    append_varint(delta, time_us - m_last_us);
+    m_last_us = time_us;
+
+    m_file << delta << record;
+    if (type == CAPTURE_FRAME) {
+        m_file.write(frame, len);
+    }
+    if (type == CAPTURE_CLOSE || now - m_last_flush >= CAPTURE_FLUSH_INTERVAL) {
+        m_file.flush();
+        m_last_flush = now;
+    }
+}
+
+bool CaptureReader::open(const std::string &path) {
+    m_file.open(path, std::ios::binary);
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (!m_file.read(magic, sizeof(magic)) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+        std::cerr << path << ": not a capture file" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool CaptureReader::read(CaptureRecord &record) {
+    uint64_t delta, connection_id, len = 0;
+    if (!read_varint(m_file, delta) || !read_varint(m_file, connection_id)) {
+        return false;
+    }
+    int type = m_file.get();
+    if (type < CAPTURE_OPEN || type > CAPTURE_CLOSE) {
+        return false;
+    }
+    if (type == CAPTURE_FRAME && !read_varint(m_file, len)) {
+        return false;
+    }
+    if (len > CAPTURE_MAX_FRAME) {
+        std::cerr << "Damaged capture record, frame of " << len << " bytes" << std::endl;
+        return false;
+    }
+
+    m_time_us += delta;
+    record.time_us = m_time_us;
+    record.connection_id = connection_id;
+    record.type = static_cast<CaptureType>(type);
+    record.frame.resize(len);
+    return static_cast<bool>(m_file.read(record.frame.data(), len));
+}
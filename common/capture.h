@@ -0,0 +1,56 @@
+/*
+ * Traffic capture file declarations
+ */
+
+/*
+ * Capture file: "CHATCAP1" magic, then records of
+ *  varint microseconds since the previous record
+ *  varint connection id
+ *  u8 record type
+ *  varint frame length, then the serialized PBMessage (frame records only)
+ */
+enum CaptureType : uint8_t {
+    CAPTURE_OPEN = 1,
+    CAPTURE_FRAME = 2,
+    CAPTURE_CLOSE = 3,
+};
+
+struct CaptureRecord {
+    // Microseconds since the capture start
+    uint64_t time_us;
+    uint32_t connection_id;
+    CaptureType type;
+    std::string frame;
+};
+
+// Records the frames received by the server, from all the connection threads
+class CaptureWriter {
+    std::ofstream m_file;
+    std::mutex m_mutex;
+    std::atomic<bool> m_is_open = false;
+    std::chrono::steady_clock::time_point m_start;
+    uint64_t m_last_us = 0;
+    std::chrono::steady_clock::time_point m_last_flush;
+
+    CaptureWriter();
+
+public:
+    ~CaptureWriter();
+
+    static CaptureWriter &instance();
+
+    bool open(const std::string &path);
+    bool is_open() const { return m_is_open; }
+
+    void write(uint32_t connection_id, CaptureType type, const char *frame = nullptr, size_t len = 0);
+};
+
+class CaptureReader {
+    std::ifstream m_file;
+    uint64_t m_time_us = 0;
+
+public:
+    bool open(const std::string &path);
+    // Fails at the end of file (or on a truncated or damaged record)
+    bool read(CaptureRecord &record);
+};
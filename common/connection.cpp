@@ -1,14 +1,26 @@
 #include <iostream>
+#include <cstring>
+#include <format>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <vector>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include "connection.h"
+#include "buffer_pool.h"
 #include "messages.pb.h"
 #include "../common/defines.h"
 
 
+// Descriptors per sendmsg(), the kernel limit is SCM_MAX_FD (253)
+#define FDS_PER_MESSAGE     250
+
 Connection::Connection(int socket_fd) : m_socket(socket_fd) {
 }
 
@@ -23,15 +35,35 @@ void Connection::force_shutdown() {
     shutdown(m_socket, SHUT_RD);
 }
 
-std::string Connection::get_peer_name() const {
-    struct sockaddr_in peer_addr;
+PeerAddress Connection::get_peer_address() const {
+    struct sockaddr_storage peer_addr;
     socklen_t peer_len = sizeof(peer_addr);
 
     if (getpeername(m_socket, (struct sockaddr*)&peer_addr, &peer_len) == 0) {
-        return std::string(inet_ntoa(peer_addr.sin_addr)) + ":"
-                + std::to_string(ntohs(peer_addr.sin_port));
+        if (peer_addr.ss_family == AF_UNIX) {
+            return PeerAddress{.family = PeerAddress::LOCAL};
+        }
+        auto addr_in = (struct sockaddr_in*)&peer_addr;
+        return PeerAddress{addr_in->sin_addr.s_addr, ntohs(addr_in->sin_port), PeerAddress::INET};
+    }
+    return PeerAddress{};
+}
+
+std::string Connection::get_peer_name() const {
+    return get_peer_address().format();
+}
+
+std::string PeerAddress::format() const {
+    switch (family) {
+    case INET: {
+        auto bytes = reinterpret_cast<const uint8_t*>(&ip);
+        return std::format("{}.{}.{}.{}:{}", bytes[0], bytes[1], bytes[2], bytes[3], port);
+    }
+    case LOCAL:
+        return "<unix-socket>";
+    default:
+        return "<error>";
     }
-    return "<error>";
 }
 
 ssize_t Connection::send_all(const void* data, size_t len, int flags) {
@@ -63,6 +95,9 @@ ssize_t Connection::recv_all(void* data, size_t len, int flags) {
             if (bytes < 0) {
                 std::cerr << "recv() error " << errno << std::endl;
             }
+            else {
+                m_peer_closed = true;
+            }
             return -1;
         }
         total_bytes += bytes;
@@ -114,20 +149,35 @@ bool Connection::wait_recv_or_stdin(bool &had_recv, bool &had_stdin) {
     return true;
 }
 
+bool Connection::append_frame(std::string &buffer, const PBMessage &message) {
+    // Reserve room for the size, then serialize message right after it
+    size_t offset = buffer.size();
+    size_t msg_size = message.ByteSizeLong();
+    buffer.resize(offset + sizeof(uint32_t) + msg_size);
+
+    uint32_t len = htonl(msg_size);
+    memcpy(buffer.data() + offset, &len, sizeof(len));
+    return message.SerializeToArray(buffer.data() + offset + sizeof(len), msg_size);
+}
+
+bool Connection::send_frames(const std::string &buffer) {
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    return send_all(buffer.data(), buffer.size(), MSG_NOSIGNAL) >= 0;
+}
+
 bool Connection::send_protobuf(const PBMessage &message) {
-    std::string buffer(message.SerializeAsString());
+    // Size and serialied message are sent by single send() call
+    size_t msg_size = message.ByteSizeLong();
+    auto buffer = BufferPool::instance().acquire(sizeof(uint32_t) + msg_size);
 
-    // Send size
-    uint32_t len = htonl(buffer.size());
-    if (send_all(&len, sizeof(len), MSG_NOSIGNAL) < 0) {
+    uint32_t len = htonl(msg_size);
+    memcpy(buffer.data(), &len, sizeof(len));
+    if (!message.SerializeToArray(buffer.data() + sizeof(len), msg_size)) {
         return false;
     }
 
-    // Send serialied message
-    if (send_all(buffer.data(), buffer.size(), MSG_NOSIGNAL) < 0) {
-        return false;
-    }
-    return true;
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    return send_all(buffer.data(), sizeof(len) + msg_size, MSG_NOSIGNAL) >= 0;
 }
 
 bool Connection::recv_protobuf(PBMessage &message) {
@@ -138,13 +188,76 @@ bool Connection::recv_protobuf(PBMessage &message) {
     }
     len = ntohl(len);
 
-    // Receive serialized message
-    std::string buffer(len, '\0');
+    // Receive serialized message, the buffer goes back to the pool right after
+    auto buffer = BufferPool::instance().acquire(len);
     if (recv_all(buffer.data(), len, 0) < 0) {
         return false;
     }
+    on_recv_frame(buffer.data(), len);
 
-    return message.ParseFromString(buffer);
+    return message.ParseFromArray(buffer.data(), len);
+}
+
+bool Connection::send_fds(const std::vector<int> &fds) {
+    // Each batch goes with a single byte of data
+    for (size_t first = 0; first < fds.size(); first += FDS_PER_MESSAGE) {
+        size_t count = std::min<size_t>(fds.size() - first, FDS_PER_MESSAGE);
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        char byte = 0;
+        iovec iov{.iov_base = &byte, .iov_len = 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+        memcpy(CMSG_DATA(cmsg), fds.data() + first, sizeof(int) * count);
+
+        std::lock_guard<std::mutex> lock(m_send_mutex);
+        if (sendmsg(m_socket, &msg, MSG_NOSIGNAL) != 1) {
+            std::cerr << "sendmsg() error " << errno << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Connection::recv_fds(std::vector<int> &fds, size_t count) {
+    while (fds.size() < count) {
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE)];
+        char byte;
+        iovec iov{.iov_base = &byte, .iov_len = 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t bytes = recvmsg(m_socket, &msg, MSG_CMSG_CLOEXEC);
+        if (bytes <= 0) {
+            if (bytes < 0) {
+                std::cerr << "recvmsg() error " << errno << std::endl;
+            }
+            return false;
+        }
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                size_t offset = fds.size();
+                fds.resize(offset + received);
+                memcpy(fds.data() + offset, CMSG_DATA(cmsg), sizeof(int) * received);
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            std::cerr << "recvmsg(): descriptors truncated" << std::endl;
+            return false;
+        }
+    }
+    return fds.size() == count;
 }
 
 // Function to overload operator<<
@@ -163,7 +276,7 @@ int connect_to_server(const std::string &host, int port) {
     int status = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res);
     if (status != 0) {
         std::cerr << "getaddrinfo error: " << gai_strerror(status) << std::endl;
-        return 1;
+        return -1;
     }
 
     // Create socket using getaddrinfo results
@@ -214,3 +327,76 @@ int create_server_socket(int port, int max_clients) {
 
     return server_fd;
 }
+
+// Connect to listening server Unix domain socket
+int connect_to_unix_server(const std::string &path) {
+    sockaddr_un address{0};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    int socket_fd = socket(AF_UNIX, SERVER_SOCKET_TYPE, 0);
+    if (socket_fd < 0) {
+        std::cerr << "Socket creation failed: " << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    if (connect(socket_fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::cerr << "Server connect failed: " << strerror(errno) << std::endl;
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+// Create and configure server Unix domain socket, for local clients
+// (of the same user only)
+int create_unix_server_socket(const std::string &path, int max_clients) {
+    sockaddr_un address{0};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    int server_fd = socket(AF_UNIX, SERVER_SOCKET_TYPE, 0);
+    if (server_fd < 0) {
+        std::cerr << "Socket creation failed " << errno << std::endl;
+        return -1;
+    }
+
+    // Remove the socket file left by previous run, not the one of a running server
+    if (connect(server_fd, (sockaddr*)&address, sizeof(address)) == 0) {
+        std::cerr << "Server already running on " << path << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    struct stat file_stat;
+    if (errno == ECONNREFUSED && lstat(path.c_str(), &file_stat) == 0 && S_ISSOCK(file_stat.st_mode)) {
+        unlink(path.c_str());
+    }
+    if (bind(server_fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        std::cerr << "Bind failed: " << strerror(errno) << std::endl;
+        close(server_fd);
+        return -1;
+    }
+
+    // Nobody can connect before listen()
+    if (chmod(path.c_str(), 0600) < 0) {
+        std::cerr << "Can't set the mode of " << path << ": " << strerror(errno) << std::endl;
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, max_clients) < 0) {
+        std::cerr << "Listen failed " << errno << std::endl;
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
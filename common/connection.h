@@ -6,13 +6,29 @@
 // Protobuf message forward declaration
 class PBMessage;
 
+// Peer address in 8 bytes, formatted only when needed
+struct PeerAddress {
+    uint32_t ip = 0;        // IPv4, network byte order
+    uint16_t port = 0;
+    enum : uint8_t {INVALID, INET, LOCAL} family = INVALID;
+
+    std::string format() const;
+};
+
 class Connection {
     int m_socket;
+    // Keep frames from multiple threads from interleaving
+    std::mutex m_send_mutex;
 
 protected:
+    // Orderly close by the peer, not an error
+    bool m_peer_closed = false;
+
     virtual ssize_t send_all(const void* data, size_t len, int flags = 0);
     virtual ssize_t recv_all(void* data, size_t len, int flags = 0);
     bool is_last_error_timeout() const;
+    // Called by recv_protobuf with each complete serialized message
+    virtual void on_recv_frame(const char *data, size_t len) {}
 
 public:
     Connection(int socket_fd=0);
@@ -20,7 +36,9 @@ public:
 
     int get_socket() const { return m_socket;}
     void force_shutdown();
+    PeerAddress get_peer_address() const;
     std::string get_peer_name() const;
+    bool is_peer_closed() const { return m_peer_closed;}
 
     int accept();
     int set_recv_timeout(int seconds);
@@ -28,11 +46,21 @@ public:
     bool wait_recv_or_stdin(bool &had_recv, bool &had_stdin);
 
     bool send_protobuf(const PBMessage &message);
+    // Pipelined sending: collect multiple frames, then send them at once
+    static bool append_frame(std::string &buffer, const PBMessage &message);
+    bool send_frames(const std::string &buffer);
     bool recv_protobuf(PBMessage &message);
 
+    // Pass file descriptors to the other process (Unix domain socket only)
+    bool send_fds(const std::vector<int> &fds);
+    // Receive count descriptors (close-on-exec), sent by send_fds
+    bool recv_fds(std::vector<int> &fds, size_t count);
+
     // Function to overload operator<<
     friend std::ostream& operator<<(std::ostream& os, const Connection& obj);
 };
 
 int connect_to_server(const std::string &host, int port);
 int create_server_socket(int port, int max_clients);
+int connect_to_unix_server(const std::string &path);
+int create_unix_server_socket(const std::string &path, int max_clients);
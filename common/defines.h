@@ -4,11 +4,48 @@
 #define SERVER_SOCKET_FAMILY    AF_INET
 #define SERVER_SOCKET_TYPE      SOCK_STREAM
 #define SERVER_PORT 8080
+// Local clients can skip TCP, connect as "unix:<path>"
+#define SERVER_UNIX_SOCKET  "/tmp/chat_server.sock"
+// The running server hands its sockets and clients over to "chat_server --upgrade"
+#define SERVER_UPGRADE_SOCKET   "/tmp/chat_server_upgrade.sock"
+// Shared memory ring for local broadcast consumers, connect as "shm:<name>"
+#define SHM_RING_NAME       "/chat_broadcast"
+#define SHM_RING_SIZE       (16 << 20)
 
 #define MAX_CLIENTS 10
 #define MAX_MESSAGE_SIZE 1024
 
 #define CLIENT_DISCONNECT_TIMEOUT 10*60
+// Connection threads mostly wait, the default stack (8 MB) is way too much
+#define CLIENT_THREAD_STACK_SIZE    (64 * 1024)
+// Also the least allowed: about 15 KB is used (with the thread local storage,
+// unoptimized build) by the search, the resume replay and the in-place storing
+#define CLIENT_THREAD_STACK_MIN     (64 * 1024)
+// Max free I/O buffers kept for reuse, per buffer size
+#define BUFFER_POOL_MAX_CACHED      (1 << 20)
 
-// Select logger file by rounding timestaps
+// Recent broadcasts kept in memory and max messages replayed on session resume
+#define RESUME_RING_SIZE    4096
+#define RESUME_MAX_REPLAY   10000
+
+// Select logger file by rounding timestaps (also message store segments)
 #define LOGFILE_TIME_ROUND  std::chrono::hours
+
+// Directory of the persistent chat messages
+#define MESSAGE_STORE_DIR   "chat_store"
+// Older segments are compacted in background, throttled not to slow the live I/O
+#define STORE_HOT_SEGMENTS      24
+#define STORE_COLD_SIZE         (64 << 20)
+#define STORE_COMPACT_INTERVAL  300
+#define STORE_COMPACT_RATE      (8 << 20)
+#define SEARCH_MAX_RESULTS  20
+
+// Directory of the !trace-dump files
+#define TRACE_DIR           "traces"
+
+// Direct messages kept for an offline user, delivered on the next login
+#define INBOX_MAX_MESSAGES  100
+
+// Server task pool for commands and storage, zero threads means one per CPU
+#define TASK_POOL_THREADS   0
+#define TASK_QUEUE_LIMIT    1024
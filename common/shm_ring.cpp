@@ -0,0 +1,203 @@
+/*
+ * ShmRing class implementation
+ */
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shm_ring.h"
+
+
+#define SHM_RING_MAGIC      0x474e495254414843ull   // "CHATRING"
+// Record length marking the unused tail, before wrap-around
+#define PAD_RECORD_LEN      0xFFFFFFFFu
+#define RECORD_ALIGN        8
+
+/*
+ * Positions are logical (ever growing), the physical offset is modulo capacity.
+ * The producer moves write_begin before writing a record and write_end after it,
+ * a consumer validates the copied record against write_begin (seqlock style).
+ */
+struct ShmRing::Header {
+    std::atomic<uint64_t> magic;
+    uint64_t capacity;
+    std::atomic<uint64_t> write_begin;
+    std::atomic<uint64_t> write_end;
+};
+
+static uint64_t record_size(size_t len) {
+    return (sizeof(uint32_t) + len + RECORD_ALIGN - 1) & ~uint64_t(RECORD_ALIGN - 1);
+}
+
+ShmRing::ShmRing() {
+}
+
+ShmRing::~ShmRing() {
+    if (m_header) {
+        if (m_is_owner) {
+            // Let the consumers know
+            m_header->magic = 0;
+            shm_unlink(m_name.c_str());
+        }
+        munmap(m_header, m_map_size);
+    }
+}
+
+bool ShmRing::map(int fd, size_t size) {
+    void *ptr = mmap(nullptr, size, m_is_owner ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "mmap() error " << errno << std::endl;
+        return false;
+    }
+    m_header = static_cast<Header*>(ptr);
+    m_data = static_cast<char*>(ptr) + sizeof(Header);
+    m_map_size = size;
+    return true;
+}
+
+bool ShmRing::create(const std::string &name, size_t capacity) {
+    capacity &= ~size_t(RECORD_ALIGN - 1);
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(Header) + capacity) < 0) {
+        std::cerr << "Can't create shared memory " << name << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    m_name = name;
+    m_is_owner = true;
+    if (!map(fd, sizeof(Header) + capacity)) {
+        return false;
+    }
+    m_header->capacity = capacity;
+    m_header->write_begin = 0;
+    m_header->write_end = 0;
+    m_header->magic = SHM_RING_MAGIC;
+    return true;
+}
+
+bool ShmRing::take_over(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        std::cerr << "Can't open shared memory " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < static_cast<off_t>(sizeof(Header))) {
+        close(fd);
+        return false;
+    }
+    m_is_owner = true;
+    if (!map(fd, size)) {
+        m_is_owner = false;
+        return false;
+    }
+    if (m_header->magic != SHM_RING_MAGIC) {
+        std::cerr << "Shared memory " << name << " is not a ring" << std::endl;
+        m_is_owner = false;
+        return false;
+    }
+    m_name = name;
+    return true;
+}
+
+bool ShmRing::write(const void *data, size_t len) {
+    uint64_t capacity = m_header->capacity;
+    uint64_t size = record_size(len);
+    if (size > capacity / 2) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_write_mutex);
+    uint64_t pos = m_header->write_end.load(std::memory_order_relaxed);
+
+    // Record must be contiguous, pad the rest of the buffer
+    uint64_t tail = capacity - pos % capacity;
+    if (size > tail) {
+        m_header->write_begin.store(pos + tail, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        uint32_t pad = PAD_RECORD_LEN;
+        memcpy(m_data + pos % capacity, &pad, sizeof(pad));
+        pos += tail;
+        m_header->write_end.store(pos, std::memory_order_release);
+    }
+
+    m_header->write_begin.store(pos + size, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    uint32_t len32 = len;
+    memcpy(m_data + pos % capacity, &len32, sizeof(len32));
+    memcpy(m_data + pos % capacity + sizeof(len32), data, len);
+    m_header->write_end.store(pos + size, std::memory_order_release);
+    return true;
+}
+
+bool ShmRing::open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        std::cerr << "Can't open shared memory " << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < static_cast<off_t>(sizeof(Header)) || !map(fd, size)) {
+        return false;
+    }
+    if (m_header->magic != SHM_RING_MAGIC) {
+        std::cerr << "Shared memory " << name << " is not a ring" << std::endl;
+        return false;
+    }
+    m_name = name;
+    m_read_pos = m_header->write_end.load(std::memory_order_acquire);
+    return true;
+}
+
+int ShmRing::read(std::string &data) {
+    uint64_t capacity = m_header->capacity;
+
+    while (true) {
+        uint64_t end = m_header->write_end.load(std::memory_order_acquire);
+        if (m_read_pos == end) {
+            return 0;
+        }
+        if (end - m_read_pos > capacity) {
+            m_read_pos = end;
+            return -1;
+        }
+
+        uint64_t offset = m_read_pos % capacity;
+        uint32_t len;
+        memcpy(&len, m_data + offset, sizeof(len));
+        uint64_t size = len == PAD_RECORD_LEN ? capacity - offset : record_size(len);
+        if (size > capacity - offset) {
+            size = 0;   // Garbage, must have been overwritten
+        }
+        else if (len != PAD_RECORD_LEN) {
+            data.assign(m_data + offset + sizeof(len), len);
+        }
+
+        // Validate: the producer did not start to overwrite what was copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t begin = m_header->write_begin.load(std::memory_order_relaxed);
+        if (size == 0 || begin - m_read_pos > capacity) {
+            m_read_pos = m_header->write_end.load(std::memory_order_acquire);
+            return -1;
+        }
+        m_read_pos += size;
+        if (len != PAD_RECORD_LEN) {
+            return 1;
+        }
+    }
+}
+
+bool ShmRing::is_closed() const {
+    return m_header->magic != SHM_RING_MAGIC;
+}
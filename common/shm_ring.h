@@ -0,0 +1,40 @@
+/*
+ * ShmRing class declaration
+ */
+
+// Single producer, multiple consumer broadcast ring in POSIX shared memory.
+// The producer never waits for the consumers, slow ones lose messages.
+class ShmRing {
+    struct Header;
+
+    std::string m_name;
+    Header *m_header = nullptr;
+    char *m_data = nullptr;
+    size_t m_map_size = 0;
+    bool m_is_owner = false;
+    // Producer: serialize writers, consumer: own position
+    std::mutex m_write_mutex;
+    uint64_t m_read_pos = 0;
+
+    bool map(int fd, size_t size);
+
+public:
+    ShmRing();
+    ~ShmRing();
+
+    // Producer side: create (replace) the shared memory object
+    bool create(const std::string &name, size_t capacity);
+    bool write(const void *data, size_t len);
+    // Upgrade: continue the ring of the previous producer process (the consumers
+    // keep reading), which gives it up without closing
+    bool take_over(const std::string &name);
+    void hand_over() { m_is_owner = false; }
+
+    // Consumer side: attach, read starts from the newest message
+    bool open(const std::string &name);
+    // Returns 1 when a message was read, 0 when there is nothing new,
+    // -1 when the producer overran this consumer (messages were lost)
+    int read(std::string &data);
+    // The producer has closed the ring
+    bool is_closed() const;
+};
@@ -0,0 +1,338 @@
+#include <iostream>
+#include <fstream>
+#include <format>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <sys/socket.h>
+
+#include "../common/defines.h"
+#include "../common/connection.h"
+#include "../common/capture.h"
+#include "messages.pb.h"
+
+
+// Wait for the server to close the connections, after all is sent
+#define CLOSE_TIMEOUT       std::chrono::seconds(5)
+// No more frames expected after this time without any
+#define QUIET_INTERVAL      std::chrono::milliseconds(200)
+// Max differences printed
+#define MAX_DIFF_LINES      10
+
+using Clock = std::chrono::steady_clock;
+
+// Replayed connection, the frames are sent by the main thread
+struct ReplayConnection {
+    uint32_t id;
+    std::unique_ptr<Connection> connection;
+    std::thread receiver;
+    bool is_send_closed = false;
+    // Send times of the requests waiting for reply (login and commands)
+    std::deque<Clock::time_point> pending;
+    // Received messages, normalized for comparison (receiver thread only)
+    std::vector<std::string> output;
+};
+
+struct ReplayStats {
+    std::mutex mutex;
+    // Notified on each reply and closed connection
+    std::condition_variable cond;
+    size_t closed = 0;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t received_bytes = 0;
+    Clock::time_point last_received;
+    std::vector<Clock::duration> latencies;
+};
+
+// Message text, without what changes between runs (times, sequence numbers,
+// resume tokens), numbers in command results are masked
+static std::vector<std::string> normalize(const PBMessage &message) {
+    std::vector<std::string> lines;
+    if (message.has_chat()) {
+        const auto &chat = message.chat();
+        lines.push_back(chat.to_user().size() ?
+                std::format("chat {} -> {}: {}", chat.from_user(), chat.to_user(), chat.text()) :
+                std::format("chat {}: {}", chat.from_user(), chat.text()));
+    }
+    else if (message.has_login()) {
+        lines.push_back(std::format("login {}", message.login().user_name()));
+    }
+    else if (message.has_result()) {
+        for (const auto &text: message.result().text()) {
+            std::string line = std::format("!{}: ", message.result().command());
+            for (char c: text) {
+                if (!isdigit(c)) {
+                    line.push_back(c);
+                }
+                else if (line.back() != '#') {
+                    line.push_back('#');
+                }
+            }
+            lines.push_back(line);
+        }
+    }
+    return lines;
+}
+
+static void receiver_loop(ReplayConnection &replay, ReplayStats &stats) {
+    PBMessage message;
+    while (replay.connection->recv_protobuf(message)) {
+        auto now = Clock::now();
+        for (auto &line: normalize(message)) {
+            replay.output.push_back(std::format("{} {}", replay.id, line));
+        }
+
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        stats.received++;
+        stats.received_bytes += message.ByteSizeLong();
+        stats.last_received = now;
+        // Streamed results end with the frame without "more"
+        bool is_reply = message.has_login() || (message.has_result() && !message.result().more());
+        if (is_reply && replay.pending.size()) {
+            stats.latencies.push_back(now - replay.pending.front());
+            replay.pending.pop_front();
+            stats.cond.notify_all();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.closed++;
+    stats.cond.notify_all();
+}
+
+static std::unique_ptr<Connection> connect(const std::string &server) {
+    int socket_fd = server.starts_with("unix:") ?
+            connect_to_unix_server(server.substr(5)) :
+            connect_to_server(server, SERVER_PORT);
+    return socket_fd < 0 ? nullptr : std::make_unique<Connection>(socket_fd);
+}
+
+static void print_stats(ReplayStats &stats, Clock::duration send_time, Clock::duration total_time) {
+    auto sec = [](Clock::duration d) {
+        return std::max(std::chrono::duration<double>(d).count(), 1e-6);
+    };
+    std::cout << std::format("Sent {} frames in {:.3f} s ({:.0f}/s), received {} frames, {} bytes in {:.3f} s ({:.0f}/s)",
+            stats.sent, sec(send_time), stats.sent / sec(send_time),
+            stats.received, stats.received_bytes, sec(total_time), stats.received / sec(total_time)) << std::endl;
+
+    auto &latencies = stats.latencies;
+    if (latencies.empty()) {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto usec = [](Clock::duration d) {
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+    Clock::duration total{0};
+    for (auto d: latencies) {
+        total += d;
+    }
+    std::cout << std::format("Reply latency ({} logins/commands): min {:.0f}, avg {:.0f}, p50 {:.0f}, "
+            "p99 {:.0f}, max {:.0f} usec", latencies.size(), usec(latencies.front()),
+            usec(total / latencies.size()), usec(latencies[latencies.size() / 2]),
+            usec(latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)]),
+            usec(latencies.back())) << std::endl;
+}
+
+// Compare as sorted lines: the order between connections is not deterministic
+static bool diff_output(const std::vector<std::string> &output, const std::string &expect_file) {
+    std::ifstream file(expect_file);
+    if (!file) {
+        std::cerr << "Can't read " << expect_file << std::endl;
+        return false;
+    }
+    std::vector<std::string> expected;
+    std::string line;
+    while (std::getline(file, line)) {
+        expected.push_back(line);
+    }
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<std::string> missing, unexpected;
+    std::set_difference(expected.begin(), expected.end(), output.begin(), output.end(),
+            std::back_inserter(missing));
+    std::set_difference(output.begin(), output.end(), expected.begin(), expected.end(),
+            std::back_inserter(unexpected));
+    if (missing.empty() && unexpected.empty()) {
+        std::cout << std::format("Output matches {} ({} lines)", expect_file, output.size()) << std::endl;
+        return true;
+    }
+
+    std::cout << std::format("Output differs from {}: {} lines missing, {} unexpected",
+            expect_file, missing.size(), unexpected.size()) << std::endl;
+    for (size_t i = 0; i < missing.size() && i < MAX_DIFF_LINES; i++) {
+        std::cout << "- " << missing[i] << std::endl;
+    }
+    for (size_t i = 0; i < unexpected.size() && i < MAX_DIFF_LINES; i++) {
+        std::cout << "+ " << unexpected[i] << std::endl;
+    }
+    return false;
+}
+
+// Shut the connections down and join their receivers, before they are destroyed
+// (on each exit once the first connection is opened)
+static void stop_receivers(std::map<uint32_t, std::unique_ptr<ReplayConnection>> &connections) {
+    for (auto &[id, replay]: connections) {
+        replay->connection->force_shutdown();
+        if (replay->receiver.joinable()) {
+            replay->receiver.join();
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string capture_file, server = "localhost", output_file, expect_file;
+    // Zero is as fast as possible
+    double speed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with("--speed=")) {
+            speed = arg.substr(8) == "max" ? 0 : std::atof(arg.c_str() + 8);
+        }
+        else if (arg.starts_with("--output=")) {
+            output_file = arg.substr(9);
+        }
+        else if (arg.starts_with("--expect=")) {
+            expect_file = arg.substr(9);
+        }
+        else if (capture_file.empty() && !arg.starts_with("--")) {
+            capture_file = arg;
+        }
+        else if (!arg.starts_with("--")) {
+            server = arg;
+        }
+        else {
+            capture_file.clear();
+            break;
+        }
+    }
+    if (capture_file.empty()) {
+        std::cerr << std::format("Usage:\n{} <capture-file> [<server>|unix:<path>] [--speed=<factor>|max] "
+                "[--output=<file>] [--expect=<file>]", argv[0]) << std::endl;
+        return 255;
+    }
+
+    CaptureReader reader;
+    if (!reader.open(capture_file)) {
+        return 255;
+    }
+
+    ReplayStats stats;
+    std::map<uint32_t, std::unique_ptr<ReplayConnection>> connections;
+    auto start = Clock::now();
+    CaptureRecord record;
+    while (reader.read(record)) {
+        if (speed > 0) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(
+                    static_cast<uint64_t>(record.time_us / speed)));
+        }
+
+        auto it = connections.find(record.connection_id);
+        if (record.type == CAPTURE_OPEN) {
+            auto connection = connect(server);
+            if (connection == nullptr) {
+                stop_receivers(connections);
+                return 255;
+            }
+            auto replay = std::make_unique<ReplayConnection>();
+            replay->id = record.connection_id;
+            replay->connection = std::move(connection);
+            replay->receiver = std::thread(receiver_loop, std::ref(*replay), std::ref(stats));
+            connections[record.connection_id] = std::move(replay);
+            continue;
+        }
+        if (it == connections.end() || it->second->is_send_closed) {
+            continue;   // Opened before the capture started
+        }
+
+        auto &replay = *it->second;
+        if (record.type == CAPTURE_CLOSE && speed == 0) {
+            // Without the original timing, broadcasts from the other connections
+            // could be missed: keep it open until everything is received
+            continue;
+        }
+        if (record.type == CAPTURE_CLOSE) {
+            // The server closes after the last reply
+            shutdown(replay.connection->get_socket(), SHUT_WR);
+            replay.is_send_closed = true;
+            continue;
+        }
+
+        PBMessage message;
+        message.ParseFromString(record.frame);
+        std::string frame;
+        Connection::append_frame(frame, message);
+        {
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            stats.sent++;
+            if (message.has_login() || message.has_command()) {
+                replay.pending.push_back(Clock::now());
+            }
+        }
+        replay.connection->send_frames(frame);
+
+        if (speed == 0 && message.has_login()) {
+            // Other connections' messages are broadcast only to the logged in
+            std::unique_lock<std::mutex> lock(stats.mutex);
+            stats.cond.wait_for(lock, CLOSE_TIMEOUT, [&] { return replay.pending.empty(); });
+        }
+    }
+    auto send_time = Clock::now() - start;
+
+    // Connections still open at the end of capture, wait for the last broadcasts
+    while (true) {
+        uint64_t received;
+        {
+            std::lock_guard<std::mutex> lock(stats.mutex);
+            received = stats.received;
+        }
+        std::this_thread::sleep_for(QUIET_INTERVAL);
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        if (received == stats.received || Clock::now() - start - send_time > CLOSE_TIMEOUT) {
+            break;
+        }
+    }
+    for (auto &[id, replay]: connections) {
+        if (!replay->is_send_closed) {
+            shutdown(replay->connection->get_socket(), SHUT_WR);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(stats.mutex);
+        if (!stats.cond.wait_for(lock, CLOSE_TIMEOUT, [&] { return stats.closed == connections.size(); })) {
+            std::cerr << "Not closed by the server: " << connections.size() - stats.closed << " connections" << std::endl;
+        }
+    }
+
+    stop_receivers(connections);
+    std::vector<std::string> output;
+    for (auto &[id, replay]: connections) {
+        output.insert(output.end(), replay->output.begin(), replay->output.end());
+    }
+    std::sort(output.begin(), output.end());
+    // Up to the last received frame, without the closing
+    auto total_time = std::max(stats.last_received, start) - start;
+
+    std::cout << std::format("Replayed {} connections from {}", connections.size(), capture_file) << std::endl;
+    print_stats(stats, send_time, total_time);
+
+    if (output_file.size()) {
+        std::ofstream file(output_file);
+        for (const auto &line: output) {
+            file << line << std::endl;
+        }
+    }
+    if (expect_file.size() && !diff_output(output, expect_file)) {
+        return 1;
+    }
+    return 0;
+}
@@ -4,32 +4,156 @@
 #include <iostream>
 #include <chrono>
 #include <format>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <vector>
+#include <array>
+#include <map>
+#include <thread>
+#include <functional>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <google/protobuf/util/time_util.h>
 
 #include "client_connection.h"
 #include "user_data.h"
+#include "task_pool.h"
+#include "config.h"
+#include "trace.h"
+#include "../common/capture.h"
 #include "../common/defines.h"
 #include "messages.pb.h"
 
 
+static std::atomic<uint32_t> s_last_id = 0;
+
 ClientConnection::ClientConnection(int socket_fd) : Connection(socket_fd), m_user(nullptr),
-    m_connected_at(std::chrono::steady_clock::now()) {
-    // recv need time-out to disconnected the client
-    set_recv_timeout(CLIENT_DISCONNECT_TIMEOUT);
+    m_id(++s_last_id), m_connected_at(std::chrono::steady_clock::now()), m_peer(get_peer_address()) {
+    m_wake_fd = eventfd(0, EFD_CLOEXEC);
 }
 
 ClientConnection::~ClientConnection() {
+    // Note: drain_offloaded() must be called before (not under clients_mutex)
+    close(m_wake_fd);
 }
 
 ssize_t ClientConnection::recv_all(void* data, size_t len, int flags) {
-    ssize_t bytes = Connection::recv_all(data, len, flags);
-    if (bytes < 0) {
-        // Set disconnect reason if recv was timed out
-        if (is_last_error_timeout()) {
+    char* ptr = static_cast<char*>(data);
+    // Received by the previous server process (or before a failed upgrade)
+    size_t total_bytes = std::min(len, m_partial_read.size());
+    memcpy(ptr, m_partial_read.data(), total_bytes);
+    m_partial_read.erase(0, total_bytes);
+
+    while (total_bytes < len) {
+        // Usually the whole frame is there already
+        ssize_t bytes = ::recv(get_socket(), ptr + total_bytes, len - total_bytes, flags | MSG_DONTWAIT);
+        if (bytes > 0) {
+            total_bytes += bytes;
+            continue;
+        }
+        if (bytes == 0) {
+            // Connection closed (still error as data are incomplete)
+            m_peer_closed = true;
+            return -1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            std::cerr << "recv() error " << errno << std::endl;
+            return -1;
+        }
+
+        if (m_is_handing_over) {
+            // The next process continues the frame
+            m_partial_read.clear();
+            if (m_is_in_frame) {
+                m_partial_read.assign(m_frame_size.data(), m_frame_size.size());
+            }
+            m_partial_read.append(ptr, total_bytes);
+            m_is_in_frame = false;
+            return -1;
+        }
+
+        // The rest of the frame, the posted tasks wait for it (woken by hand_over() too)
+        pollfd fds[] = {
+            {.fd = get_socket(), .events = POLLIN},
+            {.fd = m_wake_fd, .events = POLLIN},
+        };
+        int timeout = std::chrono::milliseconds(std::chrono::seconds(Config::get(Config::client_timeout))).count();
+        int ready = poll(fds, std::size(fds), timeout);
+        if (ready == 0) {
             m_discon_reason = "Disconnected due to inactivity";
+            return -1;
+        }
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << *this << ": poll() error " << errno << std::endl;
+            return -1;
+        }
+        if (ready > 0 && fds[1].revents) {
+            uint64_t counter;
+            read(m_wake_fd, &counter, sizeof(counter));
         }
     }
-    return bytes;
+
+    // recv_protobuf reads the size first, on_recv_frame() ends the frame
+    if (!m_is_in_frame && len == m_frame_size.size()) {
+        m_is_in_frame = true;
+        memcpy(m_frame_size.data(), data, len);
+    }
+    return total_bytes;
+}
+
+ssize_t ClientConnection::send_all(const void* data, size_t len, int flags) {
+    if (m_is_holding) {
+        std::lock_guard<std::mutex> lock(m_held_mutex);
+        // Check again, release_sends() may be done
+        if (m_is_holding) {
+            m_held.append(static_cast<const char*>(data), len);
+            return len;
+        }
+    }
+    return Connection::send_all(data, len, flags);
+}
+
+void ClientConnection::hold_sends(std::string frames) {
+    std::lock_guard<std::mutex> lock(m_held_mutex);
+    m_held = std::move(frames);
+    m_is_holding = true;
+}
+
+bool ClientConnection::release_sends() {
+    // The other threads only append while holding, so this is the only writer
+    std::string frames;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(m_held_mutex);
+            frames.clear();
+            frames.swap(m_held);
+            if (frames.empty()) {
+                m_is_holding = false;
+                return true;
+            }
+        }
+        if (Connection::send_all(frames.data(), frames.size(), MSG_NOSIGNAL) < 0) {
+            std::lock_guard<std::mutex> lock(m_held_mutex);
+            m_held.clear();
+            m_is_holding = false;
+            return false;
+        }
+    }
+}
+
+void ClientConnection::on_recv_frame(const char *data, size_t len) {
+    m_is_in_frame = false;
+    if (CaptureWriter::instance().is_open()) {
+        CaptureWriter::instance().write(m_id, CAPTURE_FRAME, data, len);
+    }
 }
 
 bool ClientConnection::do_login(const std::string &user_name) {
@@ -38,10 +162,21 @@ bool ClientConnection::do_login(const std::string &user_name) {
     if (user == nullptr) {
         return false;
     }
-    m_user = user;
+    // Login again (as other user): no more direct messages to the previous one
+    auto prev_user = m_user.exchange(user);
+    if (prev_user && prev_user != user) {
+        prev_user->remove_connection(this);
+    }
     return true;
 }
 
+void ClientConnection::logout() {
+    auto user = m_user.load();
+    if (user) {
+        user->remove_connection(this);
+    }
+}
+
 bool ClientConnection::make_user(const std::string &user_name, bool is_admin) {
     // Must be a connection from admin user
     if (!this->is_admin()) {
@@ -62,25 +197,55 @@ void ClientConnection::kickout(const std::string &reason) {
     force_shutdown();
 }
 
+std::string ConnectionInfo::get_user_name() const {
+    return user ? user->get_name() : std::format("Socket{}", socket);
+}
+
+bool ConnectionInfo::is_admin() const {
+    return user ? user->is_admin() : false;
+}
+
+std::string ConnectionInfo::format() const {
+    auto duration = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - connected_at);
+    return std::format("{}{}, IP: {}, time online {}", get_user_name(),
+            (is_admin() ? " [admin]" : ""),
+            peer.format(), duration);
+}
+
+ConnectionInfo ClientConnection::get_snapshot() const {
+    return ConnectionInfo{m_user.load(), m_peer, m_connected_at, get_socket()};
+}
+
 std::string ClientConnection::get_user_name() const {
     //TODO: Better handlig of no-user case
-    return m_user ? m_user->get_name() : std::format("Socket{}", get_socket());
+    auto user = m_user.load();
+    return user ? user->get_name() : std::format("Socket{}", get_socket());
 }
 
 bool ClientConnection::is_admin() const {
-    return m_user ? m_user->is_admin() : false;
+    auto user = m_user.load();
+    return user ? user->is_admin() : false;
 }
 
 std::string ClientConnection::get_info() const {
-    auto duration = std::chrono::duration_cast<std::chrono::seconds>(
-            std::chrono::steady_clock::now() - m_connected_at);
-    return std::format("{}{}, IP: {}, time online {}", get_user_name(),
-            (is_admin() ? " [admin]" : ""),
-            get_peer_name(), duration);
+    return get_snapshot().format();
+}
+
+size_t ClientConnection::get_heap_bytes() {
+    // Short strings are kept in the object (SSO)
+    size_t bytes = m_discon_reason.capacity() > std::string().capacity() ? m_discon_reason.capacity() + 1 : 0;
+    {
+        std::lock_guard<std::mutex> lock(m_held_mutex);
+        bytes += m_held.capacity() > std::string().capacity() ? m_held.capacity() + 1 : 0;
+    }
+    std::lock_guard<std::mutex> lock(m_post_mutex);
+    return bytes + m_posted.capacity() * sizeof(Task);
 }
 
 bool ClientConnection::store_chat(const PBChatMessage &chat) {
-    if (m_user == nullptr) {
+    auto user = m_user.load();
+    if (user == nullptr) {
         return false;
     }
 
@@ -88,5 +253,164 @@ bool ClientConnection::store_chat(const PBChatMessage &chat) {
     auto sent_at_ns = google::protobuf::util::TimeUtil::TimestampToNanoseconds(chat.sent_at());
     UserData::TimePoint sent_at{std::chrono::nanoseconds(sent_at_ns)};
 
-    return m_user->store_chat(sent_at, chat.text());
+    // Storage may block, keep it away from the connection thread.
+    // Offloaded like the commands, one at a time per connection, so the
+    // messages of a user are appended in order (no work stealing reorder)
+    static TaskStats &stats = TaskPool::instance().get_stats("store_chat");
+    uint64_t trace_id = Tracer::t_trace_id;
+    auto queued_at = trace_id ? Tracer::Clock::now() : Tracer::Clock::time_point{};
+    auto store = [user, seq = chat.seq(), sent_at, text = chat.text(), trace_id, queued_at] {
+        if (trace_id) {
+            Tracer::instance().record("store_chat queued", trace_id, queued_at, Tracer::Clock::now());
+        }
+        TRACE_SCOPE("store_chat");
+        user->store_chat(seq, sent_at, text);
+    };
+    if (!offload(stats, store, [] {})) {
+        // Queues are full, store in-place after the queued ones (slows this client only)
+        drain_offloaded();
+        TRACE_SCOPE("store_chat");
+        return user->store_chat(chat.seq(), sent_at, chat.text());
+    }
+    return true;
+}
+
+bool ClientConnection::wait_recv() {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(Config::get(Config::client_timeout));
+
+    while (true) {
+        run_posted();
+        if (m_is_handing_over) {
+            return false;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0) {
+            m_discon_reason = "Disconnected due to inactivity";
+            return false;
+        }
+
+        pollfd fds[] = {
+            {.fd = get_socket(), .events = POLLIN},
+            {.fd = m_wake_fd, .events = POLLIN},
+        };
+        if (poll(fds, std::size(fds), remaining.count()) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << *this << ": poll() error " << errno << std::endl;
+            return false;
+        }
+
+        if (fds[1].revents) {
+            uint64_t counter;
+            read(m_wake_fd, &counter, sizeof(counter));
+        }
+        if (fds[0].revents) {
+            // Data, close or error (to be detected by recv)
+            run_posted();
+            return true;
+        }
+    }
+}
+
+void ClientConnection::post(Task task) {
+    // The wake-up is under the lock: once the task is taken, the poster
+    // is done with this object (it can be destroyed)
+    std::lock_guard<std::mutex> lock(m_post_mutex);
+    m_posted.push_back(std::move(task));
+    uint64_t one = 1;
+    write(m_wake_fd, &one, sizeof(one));
+}
+
+void ClientConnection::run_posted() {
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(m_post_mutex);
+        tasks.swap(m_posted);
+    }
+    for (auto &task: tasks) {
+        task();
+    }
+}
+
+bool ClientConnection::offload(TaskStats &stats, Task work, Task then) {
+    if (m_offloaded.size() >= static_cast<size_t>(Config::get(Config::task_queue_limit))) {
+        stats.rejected++;
+        return false;
+    }
+
+    m_offloaded.push_back(OffloadItem{&stats, std::move(work), std::move(then), Tracer::t_trace_id});
+    if (m_offloaded.size() > 1) {
+        // Will be started by the continuation of the previous one
+        return true;
+    }
+
+    if (!submit_offloaded()) {
+        m_offloaded.pop_front();
+        return false;
+    }
+    return true;
+}
+
+bool ClientConnection::submit_offloaded() {
+    auto &item = m_offloaded.front();
+    return TaskPool::instance().submit(*item.stats, [this, &item] {
+        TraceContext context(item.trace_id);
+        item.work();
+        post([this] { run_offloaded_next(); });
+    });
+}
+
+void ClientConnection::run_offloaded_next() {
+    // Continuation of the completed front item
+    {
+        TraceContext context(m_offloaded.front().trace_id);
+        m_offloaded.front().then();
+    }
+    m_offloaded.pop_front();
+
+    // Start the next one, complete in-place when the queues are full
+    while (m_offloaded.size() && !submit_offloaded()) {
+        auto &item = m_offloaded.front();
+        TraceContext context(item.trace_id);
+        item.work();
+        item.then();
+        m_offloaded.pop_front();
+    }
+}
+
+void ClientConnection::drain_offloaded() {
+    while (m_offloaded.size()) {
+        pollfd fd{.fd = m_wake_fd, .events = POLLIN};
+        if (poll(&fd, 1, -1) > 0) {
+            uint64_t counter;
+            read(m_wake_fd, &counter, sizeof(counter));
+        }
+        run_posted();
+    }
+}
+
+void ClientConnection::hand_over() {
+    m_is_handing_over = true;
+    uint64_t one = 1;
+    write(m_wake_fd, &one, sizeof(one));
+}
+
+void ClientConnection::save_state(PBUpgradeConnection &state) const {
+    auto user = m_user.load();
+    if (user) {
+        state.set_user_name(user->get_name());
+    }
+    state.set_connected_at(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            m_connected_at.time_since_epoch()).count());
+    state.set_partial_read(m_partial_read);
+}
+
+void ClientConnection::restore_state(const PBUpgradeConnection &state) {
+    m_user = find_user(state.user_name(), false);
+    m_connected_at = std::chrono::steady_clock::time_point(std::chrono::duration_cast<
+            std::chrono::steady_clock::duration>(std::chrono::nanoseconds(state.connected_at())));
+    m_partial_read = state.partial_read();
 }
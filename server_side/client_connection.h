@@ -6,27 +6,122 @@
 
 class UserData;
 class PBChatMessage;
+class PBUpgradeConnection;
+struct TaskStats;
+
+// Connection details, still usable after the connection is gone
+struct ConnectionInfo {
+    std::shared_ptr<UserData> user;
+    PeerAddress peer;
+    std::chrono::steady_clock::time_point connected_at;
+    int socket;
+
+    std::string get_user_name() const;
+    bool is_admin() const;
+    std::string format() const;
+};
 
  class ClientConnection : public Connection {
-    std::shared_ptr<UserData> m_user;
+public:
+    using Task = std::function<void()>;
+
+private:
+    // Atomic, as command tasks read it from the task pool threads
+    std::atomic<std::shared_ptr<UserData>> m_user;
+    // Unique for the server run (socket numbers are reused)
+    uint32_t m_id;
     std::chrono::steady_clock::time_point m_connected_at;
+    // Cached at accept time, to avoid getpeername() on each !list
+    PeerAddress m_peer;
     std::string m_discon_reason;
 
-    // Override Connection::recv_all to set disconnect reason
+    // I/O context: tasks posted from other threads, run by the connection thread
+    int m_wake_fd;
+    std::mutex m_post_mutex;
+    // Note: vector and list don't allocate while empty (unlike deque)
+    std::vector<Task> m_posted;
+    // Offloaded tasks with continuation, run one at a time to keep the order
+    // (accessed by connection thread only)
+    struct OffloadItem {
+        TaskStats *stats;
+        Task work;
+        Task then;
+        // Traced message, both parts continue its trace
+        uint64_t trace_id;
+    };
+    std::list<OffloadItem> m_offloaded;
+
+    // Zero-downtime upgrade: the connection thread stops at the next frame, or
+    // keeps the received part of the frame for the next process
+    std::atomic<bool> m_is_handing_over = false;
+    std::string m_partial_read;
+    // Size of the frame being received (recv_protobuf reads it first)
+    bool m_is_in_frame = false;
+    std::array<char, sizeof(uint32_t)> m_frame_size;
+
+    // Frames queued instead of sent, while a resumed session is replayed outside
+    // of clients_mutex (the broadcasts meanwhile are sent after the replay)
+    std::atomic<bool> m_is_holding = false;
+    std::mutex m_held_mutex;
+    std::string m_held;
+
+    void run_posted();
+    bool submit_offloaded();
+    void run_offloaded_next();
+
+    // Override Connection::recv_all to set disconnect reason, waits for the rest
+    // of the frame with the posted tasks (hand-over)
     virtual ssize_t recv_all(void* data, size_t len, int flags);
+    // Override Connection::send_all to queue the frames while holding
+    virtual ssize_t send_all(const void* data, size_t len, int flags);
+    // Record the received frames, when the capture is on
+    virtual void on_recv_frame(const char *data, size_t len);
 
 public:
     ClientConnection(int socket_fd);
     ~ClientConnection();
 
     bool do_login(const std::string &user_name);
+    // Stop the direct messages to this connection, before it is destroyed
+    void logout();
     void kickout(const std::string &reason);
     bool make_user(const std::string &user_name, bool is_admin);
 
+    uint32_t get_id() const { return m_id;}
+    std::shared_ptr<UserData> get_user() const { return m_user.load();}
     std::string get_user_name() const;
     bool is_admin() const;
     std::string get_info() const;
+    ConnectionInfo get_snapshot() const;
     const std::string &get_disconnect_reason() const { return m_discon_reason;}
+    // Heap memory held by the connection (besides the object itself)
+    size_t get_heap_bytes();
 
     bool store_chat(const PBChatMessage &chat);
+
+    // Queue the frames, and the following ones sent by any thread, until release_sends()
+    // Note: called under clients_mutex, as no broadcast can get before the frames
+    void hold_sends(std::string frames);
+    // Send the held frames, by the connection thread (not under clients_mutex)
+    bool release_sends();
+
+    // Wait for incoming data, meanwhile run the posted tasks
+    // Fails on inactivity time-out or error
+    bool wait_recv();
+    // Run a task in the connection thread, can be called from any thread
+    void post(Task task);
+    // Run work in the task pool, then the continuation in the connection thread
+    // Fails when the queues are full
+    bool offload(TaskStats &stats, Task work, Task then);
+    // Complete the offloaded tasks, before the object is destroyed
+    void drain_offloaded();
+
+    // Zero-downtime upgrade: stop receiving (wait_recv fails), can be called from any thread
+    void hand_over();
+    // Upgrade failed, continue in this process
+    void cancel_hand_over() { m_is_handing_over = false;}
+    bool is_handing_over() const { return m_is_handing_over;}
+    // State for the new server process and back (the user is restored before)
+    void save_state(PBUpgradeConnection &state) const;
+    void restore_state(const PBUpgradeConnection &state);
 };
@@ -0,0 +1,281 @@
+/*
+ * Config class implementation
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <map>
+#include <vector>
+#include <charconv>
+#include <filesystem>
+
+#include "config.h"
+#include "../common/defines.h"
+
+
+// Optional in the working directory, other can be set by --config=<path>
+#define DEFAULT_CONFIG_FILE     "chat_server.conf"
+
+const Config::Setting Config::s_settings[key_count] = {
+    {"port", SERVER_PORT, nullptr, 1, false, "TCP port"},
+    {"unix-socket", 0, SERVER_UNIX_SOCKET, 0, false, "Unix domain socket path for local clients"},
+    {"upgrade-socket", 0, SERVER_UPGRADE_SOCKET, 0, false, "Unix domain socket for the zero-downtime upgrade"},
+    {"upgrade", 0, nullptr, 0, false, "Take over the sockets and clients of the server running on upgrade-socket"},
+    {"max-clients", MAX_CLIENTS, nullptr, 1, false, "Listen backlog (pending connections)"},
+    {"max-message-size", MAX_MESSAGE_SIZE, nullptr, 1, true, "Max chat message text, bytes"},
+    {"client-timeout", CLIENT_DISCONNECT_TIMEOUT, nullptr, 1, true, "Disconnect inactive clients, seconds"},
+    {"thread-stack-size", CLIENT_THREAD_STACK_SIZE, nullptr, CLIENT_THREAD_STACK_MIN, true, "Connection thread stack, bytes (new connections)"},
+    {"task-threads", TASK_POOL_THREADS, nullptr, 0, false, "Task pool threads, 0 for one per CPU"},
+    {"task-queue-limit", TASK_QUEUE_LIMIT, nullptr, 1, true, "Max queued tasks, per pool thread and per connection"},
+    {"buffer-pool-cache", BUFFER_POOL_MAX_CACHED, nullptr, 0, true, "Free I/O buffers kept for reuse, bytes per buffer size"},
+    {"resume-ring-size", RESUME_RING_SIZE, nullptr, 0, true, "Recent broadcasts kept in memory for resumed sessions"},
+    {"resume-max-replay", RESUME_MAX_REPLAY, nullptr, 0, true, "Max messages replayed on session resume"},
+    {"search-max-results", SEARCH_MAX_RESULTS, nullptr, 1, true, "Max messages found by !search"},
+    {"inbox-size", INBOX_MAX_MESSAGES, nullptr, 1, true, "Direct messages kept per offline user, the oldest are dropped"},
+    {"store-dir", 0, MESSAGE_STORE_DIR, 0, false, "Directory of the persistent chat messages"},
+    {"store-max-age", 0, nullptr, 0, true, "Drop stored messages older than this, seconds (0 keeps all)"},
+    {"store-max-size", 0, nullptr, 0, true, "Drop the oldest stored messages above this disk usage, bytes (0 is unlimited)"},
+    {"store-user-max", 0, nullptr, 0, true, "Keep the newest N stored messages of each user (0 is unlimited)"},
+    {"store-hot-segments", STORE_HOT_SEGMENTS, nullptr, 1, true, "Newest segments kept uncompressed, older are compacted"},
+    {"store-cold-size", STORE_COLD_SIZE, nullptr, 64 * 1024, true, "Compacted (cold) segment size limit, uncompressed bytes"},
+    {"store-compact-interval", STORE_COMPACT_INTERVAL, nullptr, 0, true, "Retention and compaction check, seconds (0 is off)"},
+    {"store-compact-rate", STORE_COMPACT_RATE, nullptr, 64 * 1024, true, "Compaction I/O limit, bytes per second"},
+    {"log-time-round", std::chrono::seconds(LOGFILE_TIME_ROUND(1)).count(), nullptr, 1, true,
+            "Log file and message store segment period, seconds"},
+    {"log-flush-interval", 0, nullptr, 0, true, "Log file flush interval, milliseconds (0 flushes each line)"},
+    {"shm-ring", 0, nullptr, 0, false, "Publish broadcasts to shared memory ring " SHM_RING_NAME},
+    {"shm-ring-size", SHM_RING_SIZE, nullptr, 4096, false, "Shared memory ring size, bytes"},
+    {"capture-file", 0, "", 0, false, "Record the received frames for chat_replay, empty for none"},
+    {"trace-sample", 0, nullptr, 0, true, "Trace one of every N messages (0 is off), see !trace-dump"},
+    {"trace-dir", 0, TRACE_DIR, 0, false, "Directory of the !trace-dump files (existing are never overwritten)"},
+    {"moderation-file", 0, "", 0, false, "Chat moderation rules, empty for none (the file is reloaded with the config)"},
+};
+
+Config::Config() {
+    for (size_t i = 0; i < key_count; i++) {
+        m_numbers[i] = s_settings[i].default_number;
+        if (s_settings[i].default_string) {
+            m_strings[i] = s_settings[i].default_string;
+        }
+    }
+}
+
+Config::~Config() {
+}
+
+Config &Config::instance() {
+    // Function static singleton for lazy initialization
+    static Config config;
+    return config;
+}
+
+std::chrono::sys_seconds Config::round_time(const std::chrono::system_clock::time_point &time) {
+    auto seconds = std::chrono::floor<std::chrono::seconds>(time);
+    return seconds - seconds.time_since_epoch() % std::chrono::seconds(get(log_time_round));
+}
+
+bool Config::parse_number(const std::string &text, int64_t &number) {
+    auto end = text.data() + text.size();
+    auto [ptr, error] = std::from_chars(text.data(), end, number);
+    if (error != std::errc() || number < 0) {
+        return false;
+    }
+    // Optional size suffix, the result must fit too
+    if (ptr != end && ptr + 1 == end) {
+        int64_t unit = 0;
+        switch (*ptr) {
+        case 'k': case 'K': unit = int64_t(1) << 10; break;
+        case 'm': case 'M': unit = int64_t(1) << 20; break;
+        case 'g': case 'G': unit = int64_t(1) << 30; break;
+        }
+        if (unit == 0 || number > INT64_MAX / unit) {
+            return false;
+        }
+        number *= unit;
+        return true;
+    }
+    return ptr == end;
+}
+
+static std::string trim(const std::string &text) {
+    auto begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return text.substr(begin, text.find_last_not_of(" \t\r") + 1 - begin);
+}
+
+bool Config::read_values(std::map<std::string, std::string> &values, std::vector<std::string> &errors) {
+    auto is_known = [](const std::string &name) {
+        for (const auto &setting: s_settings) {
+            if (name == setting.name) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::ifstream file(m_path);
+    if (!file && !(m_is_path_default && !std::filesystem::exists(m_path))) {
+        errors.push_back(std::format("Can't read config file {}", m_path));
+    }
+    std::string line;
+    for (int line_num = 1; std::getline(file, line); line_num++) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+        auto pos = line.find('=');
+        auto name = trim(line.substr(0, pos));
+        if (pos == std::string::npos || !is_known(name)) {
+            errors.push_back(std::format("{}:{}: unknown setting '{}'", m_path, line_num, line));
+            continue;
+        }
+        values[name] = trim(line.substr(pos + 1));
+    }
+
+    // Command line wins
+    for (const auto &[name, value]: m_overrides) {
+        values[name] = value;
+    }
+
+    // Validate numbers
+    for (const auto &setting: s_settings) {
+        auto it = values.find(setting.name);
+        int64_t number;
+        if (it != values.end() && !setting.default_string &&
+                (!parse_number(it->second, number) || number < setting.min_number)) {
+            errors.push_back(std::format("Invalid {} value '{}' (min {})", setting.name, it->second,
+                    setting.min_number));
+        }
+    }
+    return errors.empty();
+}
+
+bool Config::load(int argc, char **argv) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_path = DEFAULT_CONFIG_FILE;
+
+    std::vector<std::string> errors;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (!arg.starts_with("--") || arg == "--help") {
+            errors.push_back(std::format("Unexpected argument '{}'", arg));
+            continue;
+        }
+        // --<name>=<value>, --<name> <value> for config file, --<name> for flags
+        auto pos = arg.find('=');
+        auto name = arg.substr(2, pos == std::string::npos ? pos : pos - 2);
+        auto value = pos == std::string::npos ? "1" : arg.substr(pos + 1);
+        if (name == "config") {
+            if (pos == std::string::npos && i + 1 < argc) {
+                value = argv[++i];
+            }
+            m_path = value;
+            m_is_path_default = false;
+        }
+        else {
+            m_overrides[name] = value;
+        }
+    }
+    for (const auto &[name, value]: m_overrides) {
+        bool is_known = false;
+        for (const auto &setting: s_settings) {
+            is_known = is_known || name == setting.name;
+        }
+        if (!is_known) {
+            errors.push_back(std::format("Unknown option '--{}'", name));
+        }
+    }
+
+    std::map<std::string, std::string> values;
+    if (errors.empty()) {
+        read_values(values, errors);
+    }
+    if (errors.size()) {
+        for (const auto &error: errors) {
+            std::cerr << error << std::endl;
+        }
+        std::cerr << std::format("Usage:\n{} [--config=<path>] [--<setting>=<value>]...\nSettings:", argv[0])
+                << std::endl;
+        for (const auto &setting: s_settings) {
+            std::cerr << std::format("  --{}  {}{}", setting.name, setting.description,
+                    setting.is_hot ? "" : " (restart)") << std::endl;
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < key_count; i++) {
+        auto it = values.find(s_settings[i].name);
+        if (it == values.end()) {
+            continue;
+        }
+        if (s_settings[i].default_string) {
+            m_strings[i] = it->second;
+        }
+        else {
+            int64_t number;
+            parse_number(it->second, number);
+            m_numbers[i] = number;
+        }
+    }
+    return true;
+}
+
+std::vector<std::string> Config::reload() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::map<std::string, std::string> values;
+    std::vector<std::string> report;
+    if (!read_values(values, report)) {
+        report.push_back("Config not reloaded");
+        return report;
+    }
+
+    for (size_t i = 0; i < key_count; i++) {
+        const auto &setting = s_settings[i];
+        // Removed setting is back to default
+        auto it = values.find(setting.name);
+        if (setting.default_string) {
+            auto value = it == values.end() ? setting.default_string : it->second;
+            if (value != m_strings[i]) {
+                report.push_back(std::format("{}: '{}' needs restart", setting.name, value));
+            }
+            continue;
+        }
+
+        int64_t number = setting.default_number;
+        if (it != values.end()) {
+            parse_number(it->second, number);
+        }
+        if (number == m_numbers[i]) {
+            continue;
+        }
+        if (setting.is_hot) {
+            report.push_back(std::format("{}: {} -> {}", setting.name, m_numbers[i].load(), number));
+            m_numbers[i] = number;
+        }
+        else {
+            report.push_back(std::format("{}: {} needs restart", setting.name, number));
+        }
+    }
+
+    if (report.empty()) {
+        report.push_back("No changes");
+    }
+    return report;
+}
+
+std::vector<std::string> Config::get_report() {
+    std::vector<std::string> report{std::format("Config file {}:", m_path)};
+    for (size_t i = 0; i < key_count; i++) {
+        auto value = s_settings[i].default_string ? m_strings[i] : std::to_string(m_numbers[i]);
+        report.push_back(std::format("  {} = {}{}", s_settings[i].name, value,
+                s_settings[i].is_hot ? "" : " (restart)"));
+    }
+    return report;
+}
@@ -0,0 +1,94 @@
+/*
+ * Config class declaration
+ */
+
+// Server settings: defaults from defines.h, overridden by the config file
+// ("<name> = <value>" lines), then by "--<name>=<value>" command line options.
+// The hot settings are applied by reload() while running, others need restart.
+class Config {
+public:
+    enum Key {
+        port,
+        unix_socket,
+        upgrade_socket,
+        upgrade,
+        max_clients,
+        max_message_size,
+        client_timeout,
+        thread_stack_size,
+        task_threads,
+        task_queue_limit,
+        buffer_pool_cache,
+        resume_ring_size,
+        resume_max_replay,
+        search_max_results,
+        inbox_size,
+        store_dir,
+        store_max_age,
+        store_max_size,
+        store_user_max,
+        store_hot_segments,
+        store_cold_size,
+        store_compact_interval,
+        store_compact_rate,
+        log_time_round,
+        log_flush_interval,
+        shm_ring,
+        shm_ring_size,
+        capture_file,
+        trace_sample,
+        trace_dir,
+        moderation_file,
+        key_count
+    };
+
+private:
+    struct Setting {
+        const char *name;
+        int64_t default_number;
+        // Null for number settings
+        const char *default_string;
+        int64_t min_number;
+        bool is_hot;
+        const char *description;
+    };
+    static const Setting s_settings[key_count];
+
+    // Numbers are read lock-free by any thread, strings are never changed after load()
+    std::array<std::atomic<int64_t>, key_count> m_numbers;
+    std::array<std::string, key_count> m_strings;
+    std::string m_path;
+    bool m_is_path_default = true;
+    std::map<std::string, std::string> m_overrides;
+    std::mutex m_mutex;
+
+    Config();
+
+    // Parse the file with the command line overrides on top
+    bool read_values(std::map<std::string, std::string> &values, std::vector<std::string> &errors);
+
+public:
+    ~Config();
+
+    // Not negative decimal number, with an optional k, M or G (1024 based) suffix
+    static bool parse_number(const std::string &text, int64_t &number);
+
+    static Config &instance();
+
+    static int64_t get(Key key) {
+        return instance().m_numbers[key].load(std::memory_order_relaxed);
+    }
+    static const std::string &get_string(Key key) {
+        return instance().m_strings[key];
+    }
+
+    // Start of the log file and message store period (LOG_TIME_ROUND) with the time
+    static std::chrono::sys_seconds round_time(const std::chrono::system_clock::time_point &time);
+
+    // Initial load, prints the errors and usage
+    bool load(int argc, char **argv);
+    // Re-read the config file, apply the hot settings, report the changes
+    std::vector<std::string> reload();
+
+    std::vector<std::string> get_report();
+};
@@ -0,0 +1,116 @@
+/*
+ * Config test: number parsing, minimums, command line overrides and the
+ * hot reload (only the hot settings change)
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <array>
+#include <map>
+#include <vector>
+#include <unistd.h>
+
+#include "config.h"
+#include "../common/defines.h"
+
+
+// Config file written to the working directory (removed at the end)
+#define TEST_CONFIG_FILE    "config_test.conf"
+
+static int s_errors = 0;
+
+static void check(bool is_ok, const std::string &what) {
+    if (!is_ok) {
+        std::cerr << "Failed: " << what << std::endl;
+        s_errors++;
+    }
+}
+
+static void check_number(const std::string &text, bool is_valid, int64_t expected = 0) {
+    int64_t number = -1;
+    bool is_parsed = Config::parse_number(text, number);
+    check(is_parsed == is_valid && (!is_valid || number == expected),
+            std::format("parse_number(\"{}\") is {} {}", text, is_parsed, number));
+}
+
+static bool write_config(const std::string &text) {
+    std::ofstream file(TEST_CONFIG_FILE);
+    file << text;
+    return static_cast<bool>(file);
+}
+
+static bool has_line(const std::vector<std::string> &report, const std::string &line) {
+    for (const auto &report_line: report) {
+        if (report_line == line) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    check_number("0", true, 0);
+    check_number("1024", true, 1024);
+    check_number("4k", true, 4 << 10);
+    check_number("4K", true, 4 << 10);
+    check_number("2M", true, 2 << 20);
+    check_number("8g", true, int64_t(8) << 30);
+    check_number("9223372036854775807", true, INT64_MAX);
+    check_number("8589934591G", true, int64_t(8589934591) << 30);
+    // Overflow, also by the suffix
+    check_number("9223372036854775808", false);
+    check_number("9007199254740992k", false);
+    check_number("8589934592G", false);
+    // Bad suffix or text
+    check_number("", false);
+    check_number("k", false);
+    check_number("4x", false);
+    check_number("4kb", false);
+    check_number("4 k", false);
+    check_number("-1", false);
+    check_number("+1", false);
+    check_number("0x10", false);
+
+    // The command line wins over the file
+    char arg0[] = "config_test", arg1[] = "--config=" TEST_CONFIG_FILE, arg2[] = "--port=9000";
+    char *args[] = {arg0, arg1, arg2};
+    if (!write_config("max-message-size = 2k  # comment\nmax-clients = 20\nport = 1234\n") ||
+            !Config::instance().load(3, args)) {
+        std::cerr << "Can't load " << TEST_CONFIG_FILE << std::endl;
+        return 1;
+    }
+    check(Config::get(Config::port) == 9000, "command line port");
+    check(Config::get(Config::max_message_size) == 2048, "max-message-size from the file");
+    check(Config::get(Config::max_clients) == 20, "max-clients from the file");
+
+    // Below the minimum, bad suffix, unknown setting: nothing is applied
+    for (const auto &text: {"max-message-size = 0\n", "max-message-size = 3q\n",
+            "max-message-size = 3k\nno-such = 1\n", "thread-stack-size = 16k\n"}) {
+        write_config(text);
+        auto report = Config::instance().reload();
+        check(has_line(report, "Config not reloaded"), std::format("reload of '{}' refused", text));
+        check(Config::get(Config::max_message_size) == 2048, std::format("'{}' not applied", text));
+    }
+
+    // Hot ones change, the others only report; removed ones are back to default
+    write_config("max-message-size = 4k\nmax-clients = 50\nstore-dir = other\n");
+    auto report = Config::instance().reload();
+    check(has_line(report, "max-message-size: 2048 -> 4096"), "hot setting reported");
+    check(Config::get(Config::max_message_size) == 4096, "hot setting applied");
+    check(has_line(report, "max-clients: 50 needs restart"), "restart setting reported");
+    check(Config::get(Config::max_clients) == 20, "restart setting not applied");
+    check(has_line(report, "store-dir: 'other' needs restart"), "string setting reported");
+    check(Config::get(Config::port) == 9000, "command line kept");
+
+    write_config("max-clients = 20\n");
+    report = Config::instance().reload();
+    check(Config::get(Config::max_message_size) == MAX_MESSAGE_SIZE, "removed hot setting is default");
+    unlink(TEST_CONFIG_FILE);
+
+    std::cout << std::format("Config: {} errors", s_errors) << std::endl;
+    return s_errors ? 1 : 0;
+}
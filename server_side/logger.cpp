@@ -8,9 +8,14 @@
 #include <format>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <array>
+#include <map>
+#include <vector>
 
 #include "logger.h"
-#include "../common/defines.h"
+#include "config.h"
+#include "trace.h"
 
 
 #define LOG_FILENAME_FMT    "log_{:%Y-%m-%d %H_%M}.txt"
@@ -32,7 +37,7 @@ Logger::TimePoint Logger::select_logfile() {
     std::lock_guard<std::mutex> lock(log_mutex);
     auto now = std::chrono::system_clock::now();
 
-    auto filename = std::format(LOG_FILENAME_FMT, time_point_cast<LOGFILE_TIME_ROUND>(now));
+    auto filename = std::format(LOG_FILENAME_FMT, Config::round_time(now));
     if (m_curent_filename != filename) {
         m_curent_filename = filename;
 
@@ -47,6 +52,7 @@ Logger::TimePoint Logger::select_logfile() {
 }
 
 void Logger::write(std::string_view log_message) {
+    TRACE_SCOPE("Logger::log");
     auto now = select_logfile();
 
     std::ostringstream oss;
@@ -55,5 +61,29 @@ void Logger::write(std::string_view log_message) {
 
     // Lock to avoid interleaved or corrupted output
     std::lock_guard<std::mutex> lock(log_mutex);
-    m_logstream << oss.str() << std::flush;
+    m_logstream << oss.str();
+
+    // Flush each line, unless less frequent flushing is configured
+    auto flush_interval = std::chrono::milliseconds(Config::get(Config::log_flush_interval));
+    auto steady_now = std::chrono::steady_clock::now();
+    if (steady_now - m_last_flush >= flush_interval) {
+        m_logstream.flush();
+        m_last_flush = steady_now;
+        m_is_unflushed = false;
+    }
+    else {
+        m_is_unflushed = true;
+    }
+}
+
+void Logger::flush_idle() {
+    auto &logger = instance();
+    std::lock_guard<std::mutex> lock(log_mutex);
+    auto flush_interval = std::chrono::milliseconds(Config::get(Config::log_flush_interval));
+    auto steady_now = std::chrono::steady_clock::now();
+    if (logger.m_is_unflushed && steady_now - logger.m_last_flush >= flush_interval) {
+        logger.m_logstream.flush();
+        logger.m_last_flush = steady_now;
+        logger.m_is_unflushed = false;
+    }
 }
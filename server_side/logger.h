@@ -5,6 +5,9 @@
 class Logger {
     std::string m_curent_filename;
     std::ofstream m_logstream;
+    std::chrono::steady_clock::time_point m_last_flush;
+    // Lines written after the last flush (log-flush-interval)
+    bool m_is_unflushed = false;
 
     Logger();
 
@@ -19,4 +22,7 @@ public:
     }
 
     void write(std::string_view log_message);
+    // Flush the lines kept by log-flush-interval, when no more lines come
+    // Called periodically (signal thread)
+    static void flush_idle();
 };
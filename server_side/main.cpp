@@ -1,12 +1,39 @@
 #include <list>
+#include <memory_resource>
 #include <format>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <fstream>
 #include <chrono>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <sstream>
+#include <array>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <csignal>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include <google/protobuf/util/time_util.h>
 
 #include "../common/defines.h"
+#include "../common/shm_ring.h"
+#include "../common/buffer_pool.h"
+#include "../common/capture.h"
 #include "client_connection.h"
+#include "user_data.h"
+#include "task_pool.h"
+#include "message_store.h"
+#include "config.h"
+#include "trace.h"
+#include "moderation.h"
 #include "logger.h"
 #include "messages.pb.h"
 
@@ -17,9 +44,78 @@ bool g_server_running = true;
 // All connected clients
 // Use std::list to avoid move of ClientConnection objects in memory and
 // to allow keeping iterators for the whole object lifecycle
-typedef std::list<ClientConnection> ConnectionList;
-ConnectionList client_connections;
+// The list nodes are recycled by the pool (guarded by clients_mutex as the list)
+typedef std::pmr::list<ClientConnection> ConnectionList;
+std::pmr::unsynchronized_pool_resource g_connections_pool;
+ConnectionList client_connections(&g_connections_pool);
 std::mutex clients_mutex;
+// Connection threads stop and exit for the upgrade (guarded by clients_mutex)
+std::condition_variable g_clients_cond;
+bool g_is_upgrading = false;
+std::vector<ConnectionList::iterator> g_parked_clients;
+
+// Optional shared memory ring, gets a copy of each broadcast
+std::unique_ptr<ShmRing> g_shm_ring;
+
+// Last broadcast sequence number and the recent broadcast frames, to replay
+// to resumed sessions (guarded by clients_mutex)
+uint64_t g_broadcast_seq = 0;
+std::deque<std::pair<uint64_t, std::string>> g_resume_ring;
+
+// Max lines in a single command result frame, larger results are streamed
+#define RESULT_CHUNK_LINES  100
+// Connections per page, for "!list <filter> <page>"
+#define LIST_PAGE_SIZE      100
+// Default !trace-dump file, in trace-dir
+#define TRACE_FILENAME_FMT  "trace_{:%Y-%m-%d %H_%M_%S}.json"
+// Reply to the sender of a message rejected by the moderation rules
+#define MODERATION_REJECTED "Message not sent, blocked by moderation"
+// Upgrade: the connection threads to stop, then the new process to confirm, seconds
+#define UPGRADE_TIMEOUT     30
+// Signal thread: period of the housekeeping (log flush) between the signals, milliseconds
+#define SIGNAL_WAIT_MIN_MS  10
+#define SIGNAL_WAIT_MAX_MS  1000
+// Resume: waits for a missed message, not in the ring but still queued for the store
+#define RESUME_STORE_WAITS  3
+
+// Copy of all connection details, used by !list without clients_mutex
+struct ConnectionsSnapshot {
+    uint64_t generation;
+    std::vector<ConnectionInfo> connections;
+};
+// Changed on each connect, login and disconnect to invalidate the snapshot
+std::atomic<uint64_t> g_connections_generation = 0;
+std::atomic<std::shared_ptr<const ConnectionsSnapshot>> g_connections_snapshot;
+
+static std::shared_ptr<const ConnectionsSnapshot> get_connections_snapshot() {
+    // Reuse the last snapshot, if no connection was changed since
+    auto snapshot = g_connections_snapshot.load();
+    if (snapshot && snapshot->generation == g_connections_generation) {
+        return snapshot;
+    }
+
+    // Rebuild: only copy under the lock, format later
+    auto new_snapshot = std::make_shared<ConnectionsSnapshot>();
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        new_snapshot->generation = g_connections_generation;
+        new_snapshot->connections.reserve(client_connections.size());
+        for (const auto &client: client_connections) {
+            new_snapshot->connections.push_back(client.get_snapshot());
+        }
+    }
+    g_connections_snapshot.store(new_snapshot);
+    return new_snapshot;
+}
+
+// Send the collected part of a command result, the rest is to follow
+static bool send_partial_result(ClientConnection &client, PBCommandResult &result) {
+    PBMessage message;
+    message.mutable_result()->set_command(result.command());
+    message.mutable_result()->mutable_text()->Swap(result.mutable_text());
+    message.mutable_result()->set_more(true);
+    return client.send_protobuf(message);
+}
 
 bool kickout_client(ClientConnection &by_client, const std::string &user_name, bool kick_all=false) {
     bool client_found = false;
@@ -44,6 +140,75 @@ bool make_admin(ClientConnection &by_client, const std::string &user_name) {
     return res;
 }
 
+static void prepare_chat_message(PBChatMessage &chat) {
+    const google::protobuf::Timestamp now = google::protobuf::util::TimeUtil::GetCurrentTime();
+    chat.mutable_sent_at()->CopyFrom(now);
+}
+
+// Send only to the recipient's connections, found by the user database
+// (without clients_mutex), kept in its inbox while offline
+// Returns the text for the sender, empty when delivered
+static std::string send_direct_chat(const std::string &text, const std::string &to_user,
+        ClientConnection &from_client) {
+    auto recipient = find_user(to_user, false);
+    if (recipient == nullptr) {
+        return std::format("Message not sent, unknown user {}", to_user);
+    }
+    Logger::log("[DIRECT] {} -> {}: {}", from_client.get_user_name(), to_user, text);
+
+    PBMessage message;
+    prepare_chat_message(*message.mutable_chat());
+    message.mutable_chat()->set_from_user(from_client.get_user_name());
+    message.mutable_chat()->set_to_user(to_user);
+    message.mutable_chat()->set_text(text);
+
+    std::string frame;
+    {
+        TRACE_SCOPE("serialize");
+        if (!Connection::append_frame(frame, message)) {
+            return "Message not sent";
+        }
+    }
+    size_t sent;
+    {
+        TRACE_SCOPE("deliver direct");
+        sent = recipient->deliver(frame);
+    }
+    return sent ? "" : std::format("{} is offline, the message is kept for the next login", to_user);
+}
+
+// Check the chat text by the moderation rules, redacted in place
+// Returns false when rejected
+static bool moderate_chat(std::string &text, ClientConnection &client) {
+    TRACE_SCOPE("moderation");
+    std::string rule;
+    auto action = ModerationFilter::instance().check(text, rule);
+    if (action == ModerationFilter::PASS) {
+        return true;
+    }
+    Logger::log("[MODERATION] {}: {} by '{}': {}", client.get_user_name(),
+            action == ModerationFilter::REJECT ? "rejected" :
+            action == ModerationFilter::REDACT ? "redacted" : "flagged", rule, text);
+    return action != ModerationFilter::REJECT;
+}
+
+// Pass the hot settings to the components, which keep their own copy
+static void apply_config() {
+    BufferPool::instance().set_max_cached_bytes(Config::get(Config::buffer_pool_cache));
+    TaskPool::instance().set_queue_limit(Config::get(Config::task_queue_limit));
+    Tracer::instance().set_sampling(Config::get(Config::trace_sample));
+}
+
+static std::vector<std::string> reload_config() {
+    auto report = Config::instance().reload();
+    apply_config();
+    ModerationFilter::instance().load(Config::get_string(Config::moderation_file), report);
+    for (const auto &line: report) {
+        Logger::log("[SYSTEM] Config reload: {}", line);
+    }
+    return report;
+}
+
 /*
  * Map of command-string to call-back function
  */
@@ -58,10 +223,162 @@ const std::map<const std::string,
     {"help", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
         result.add_text("Available commands:");
         result.add_text(" !help");
+        result.add_text(" !ping");
+        result.add_text(" !msg <user> <text>");
+        result.add_text(" !pool");
+        result.add_text(" !mem");
+        result.add_text(" !config");
+        result.add_text(" !reload");
+        result.add_text(" !trace-dump [<file>]");
         result.add_text(" !quit");
-        result.add_text(" !list");
+        result.add_text(" !list [<user-filter>|*] [<page>]");
         result.add_text(" !kickout");
         result.add_text(" !make-admin");
+        result.add_text(" !search <words> [user:<name>] [since:<N>m|h|d]");
+        result.add_text(" !store [compact]");
+        result.add_text(" !moderation");
+        return true;
+    }},
+    /*
+     * !ping command (round-trip measurement)
+     */
+    {"ping", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        result.add_text("pong");
+        return true;
+    }},
+    /*
+     * !msg command (direct message)
+     */
+    {"msg", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        const auto &parameter = command.parameter();
+        auto space = parameter.find(' ');
+        if (space == std::string::npos || space == 0) {
+            result.add_text("Usage: !msg <user> <text>");
+            return false;
+        }
+        auto to_user = parameter.substr(0, space);
+        auto text = parameter.substr(space + 1);
+        if (text.size() > static_cast<size_t>(Config::get(Config::max_message_size))) {
+            result.add_text(std::format("Message not sent, longer than {} bytes",
+                    Config::get(Config::max_message_size)));
+            return false;
+        }
+        if (!moderate_chat(text, client)) {
+            result.add_text(MODERATION_REJECTED);
+            return false;
+        }
+        auto reply_text = send_direct_chat(text, to_user, client);
+        result.add_text(reply_text.size() ? reply_text : std::format("Message sent to {}", to_user));
+        return true;
+    }},
+    /*
+     * !pool command (task pool latency metrics)
+     */
+    {"pool", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        for (const auto &line: TaskPool::instance().get_report()) {
+            result.add_text(line);
+        }
+        return true;
+    }},
+    /*
+     * !mem command (memory per connection)
+     */
+    {"mem", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+
+        size_t count = 0, heap_bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            for (auto &connection: client_connections) {
+                heap_bytes += connection.get_heap_bytes();
+                count++;
+            }
+        }
+        size_t io_bytes = BufferPool::instance().get_in_use_bytes();
+        size_t per_connection = sizeof(ClientConnection) + 2 * sizeof(void*)
+                + (heap_bytes + io_bytes) / std::max<size_t>(count, 1);
+
+        result.add_text(std::format("{} connections, per connection:", count));
+        result.add_text(std::format("  object + list node: {} B", sizeof(ClientConnection) + 2 * sizeof(void*)));
+        result.add_text(std::format("  heap (strings, queues): {} B average", heap_bytes / std::max<size_t>(count, 1)));
+        result.add_text(std::format("  I/O buffers: {} B average (none while idle)", io_bytes / std::max<size_t>(count, 1)));
+        result.add_text(std::format("  total: {} B, plus thread stack ({} KB reserved) and kernel socket buffers",
+                per_connection, Config::get(Config::thread_stack_size) / 1024));
+        result.add_text(std::format("Buffer pool: {} B in use, {} B cached",
+                io_bytes, BufferPool::instance().get_cached_bytes()));
+        for (const auto &line: BufferPool::instance().get_report()) {
+            result.add_text(line);
+        }
+
+        // Resident set size, the second field in pages
+        std::ifstream statm("/proc/self/statm");
+        size_t total_pages = 0, rss_pages = 0;
+        if (statm >> total_pages >> rss_pages) {
+            size_t rss_bytes = rss_pages * sysconf(_SC_PAGESIZE);
+            result.add_text(std::format("Process RSS: {} KB ({} B per connection)",
+                    rss_bytes / 1024, rss_bytes / std::max<size_t>(count, 1)));
+        }
+        return true;
+    }},
+    /*
+     * !config command (current settings)
+     */
+    {"config", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+        for (const auto &line: Config::instance().get_report()) {
+            result.add_text(line);
+        }
+        return true;
+    }},
+    /*
+     * !reload command (re-read config file, same as SIGHUP)
+     */
+    {"reload", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+        for (const auto &line: reload_config()) {
+            result.add_text(line);
+        }
+        return true;
+    }},
+    /*
+     * !trace-dump command (sampled message traces, see trace-sample setting)
+     */
+    {"trace-dump", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+        // Only a file name, the files are kept in trace-dir
+        auto file_name = command.parameter().size() ? command.parameter() :
+                std::format(TRACE_FILENAME_FMT, std::chrono::floor<std::chrono::seconds>(
+                        std::chrono::system_clock::now()));
+        if (file_name.find_first_of(std::string_view("/\0", 2)) != std::string::npos ||
+                file_name.find("..") != std::string::npos) {
+            result.add_text("Invalid file name (no path allowed)");
+            return false;
+        }
+        const auto &directory = Config::get_string(Config::trace_dir);
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        auto path = (std::filesystem::path(directory) / file_name).string();
+        size_t count;
+        if (!Tracer::instance().dump(path, count)) {
+            result.add_text(std::format("Can't create {} (existing files are not overwritten)", path));
+            return false;
+        }
+        result.add_text(std::format("{} trace events written to {} (Chrome trace format)", count, path));
+        if (!Config::get(Config::trace_sample)) {
+            result.add_text("Tracing is off, set trace-sample to enable");
+        }
         return true;
     }},
     /*
@@ -82,12 +399,49 @@ const std::map<const std::string,
     /*
      * !list command
      */
-    {"list", [](const PBChatCommand &command, ClientConnection &_, PBCommandResult &result) {
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        result.add_text(std::format("{} connections:", client_connections.size()));
-        for (const auto &client: client_connections) {
+    {"list", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        // Parameters: [<user-filter>|*] [<page>]
+        std::istringstream params(command.parameter());
+        std::string filter;
+        size_t page = 0;
+        params >> filter >> page;
+        if (filter == "*") {
+            filter.clear();
+        }
+
+        auto snapshot = get_connections_snapshot();
+        std::vector<const ConnectionInfo*> matches;
+        for (const auto &info: snapshot->connections) {
+            if (filter.empty() || info.get_user_name().find(filter) != std::string::npos) {
+                matches.push_back(&info);
+            }
+        }
+
+        size_t begin = 0, end = matches.size();
+        if (page) {
+            begin = std::min((page - 1) * LIST_PAGE_SIZE, matches.size());
+            end = std::min(begin + LIST_PAGE_SIZE, matches.size());
+            result.add_text(std::format("{} connections, {} matching, page {}/{}:",
+                    snapshot->connections.size(), matches.size(), page,
+                    (matches.size() + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE));
+        }
+        else if (filter.size()) {
+            result.add_text(std::format("{} connections, {} matching:",
+                    snapshot->connections.size(), matches.size()));
+        }
+        else {
+            result.add_text(std::format("{} connections:", snapshot->connections.size()));
+        }
+
+        for (size_t i = begin; i < end; i++) {
             //TODO: More connection details
-            result.add_text(std::format("  {}", client.get_info()));
+            result.add_text(std::format("  {}", matches[i]->format()));
+            // Stream large lists in multiple frames
+            if (result.text_size() >= RESULT_CHUNK_LINES && i + 1 < end) {
+                if (!send_partial_result(client, result)) {
+                    return false;
+                }
+            }
         }
         return true;
     }},
@@ -124,6 +478,78 @@ const std::map<const std::string,
         }
         return user_found;
     }},
+    /*
+     * !moderation command (rules and counters)
+     */
+    {"moderation", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+        for (const auto &line: ModerationFilter::instance().get_report()) {
+            result.add_text(line);
+        }
+        return true;
+    }},
+    /*
+     * !store command (message store tiers and compaction)
+     */
+    {"store", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        if (!client.is_admin()) {
+            result.add_text("Unathorized operation");
+            return false;
+        }
+        if (command.parameter() == "compact") {
+            MessageStore::instance().compact_now();
+            result.add_text("Compaction started");
+        }
+        for (const auto &line: MessageStore::instance().get_report()) {
+            result.add_text(line);
+        }
+        return true;
+    }},
+    /*
+     * !search command
+     */
+    {"search", [](const PBChatCommand &command, ClientConnection &client, PBCommandResult &result) {
+        // Parameters: <words> [user:<name>] [since:<N>m|h|d]
+        std::istringstream params(command.parameter());
+        std::string token, words, user_name;
+        MessageStore::TimePoint since{};
+        while (params >> token) {
+            if (token.starts_with("user:")) {
+                user_name = token.substr(5);
+            }
+            else if (token.starts_with("since:") && token.size() > 7) {
+                std::chrono::minutes age(std::atoll(token.c_str() + 6));
+                switch (token.back()) {
+                case 'd': age *= 24; [[fallthrough]];
+                case 'h': age *= 60; [[fallthrough]];
+                case 'm': break;
+                default:
+                    result.add_text(std::format("Invalid '{}', use since:<N>m|h|d", token));
+                    return false;
+                }
+                since = std::chrono::system_clock::now() - age;
+            }
+            else {
+                words += token + " ";
+            }
+        }
+        if (words.empty() && user_name.empty()) {
+            result.add_text("Nothing to search, type !help");
+            return false;
+        }
+
+        auto messages = MessageStore::instance().search(words, user_name, since,
+                Config::get(Config::search_max_results));
+        result.add_text(std::format("{} messages found:", messages.size()));
+        for (const auto &msg: messages) {
+            result.add_text(std::format("  {:%Y-%m-%d %H:%M:%S} {}: {}",
+                    std::chrono::floor<std::chrono::seconds>(msg.sent_at), msg.user_name, msg.text));
+        }
+        return true;
+    }},
 };
 
 static bool run_command(const PBChatCommand &command, ClientConnection &from_client) {
@@ -133,33 +559,168 @@ static bool run_command(const PBChatCommand &command, ClientConnection &from_cli
     // Obtain command call-back from the global map
     auto it = g_command_map.find(command.command());
 
-    PBMessage message;
-    message.mutable_result()->set_command(command.command());
-    if (it != g_command_map.end()) {
-        // Invoke the command
-        auto result = it->second(command, from_client, *message.mutable_result());
-    }
-    else {
+    auto message = std::make_shared<PBMessage>();
+    message->mutable_result()->set_command(command.command());
+    if (it == g_command_map.end()) {
         // Reply with unsupported command result
-        message.mutable_result()->add_text(std::format(
+        message->mutable_result()->add_text(std::format(
                 "Unsupported command '{}'", command.command()));
+        return from_client.send_protobuf(*message);
+    }
+
+    // Invoke the command in the task pool, send the result from the client thread
+    auto &stats = TaskPool::instance().get_stats("!" + command.command());
+    auto &callback = it->second;
+    bool offloaded = from_client.offload(stats,
+            [&callback, command, message, &from_client] {
+                TRACE_SCOPE("command");
+                callback(command, from_client, *message->mutable_result());
+            },
+            [message, &from_client] {
+                TRACE_SCOPE("send result");
+                from_client.send_protobuf(*message);
+            });
+    if (!offloaded) {
+        message->mutable_result()->add_text("Server is busy, try again later");
+        return from_client.send_protobuf(*message);
     }
-    return from_client.send_protobuf(message);
+    return true;
 }
 
-static void prepare_chat_message(PBChatMessage &chat) {
-    const google::protobuf::Timestamp now = google::protobuf::util::TimeUtil::GetCurrentTime();
-    chat.mutable_sent_at()->CopyFrom(now);
+// Reply to successful login: session resume token and current sequence number
+static void append_login_reply(std::string &frames, ClientConnection &client, uint64_t last_seq) {
+    auto user = find_user(client.get_user_name(), false);
+    PBMessage reply;
+    reply.mutable_login()->set_user_name(client.get_user_name());
+    reply.mutable_login()->set_resume_token(user ? user->get_resume_token() : "");
+    reply.mutable_login()->set_last_seq(last_seq);
+    Connection::append_frame(frames, reply);
+}
+
+// Replay the broadcasts, missed since login.last_seq(), in a single write
+static bool resume_session(const PBUserLogin &login, ClientConnection &client) {
+    uint64_t replay_after = login.last_seq();
+    size_t max_replay = Config::get(Config::resume_max_replay);
+    std::string replay_frames;
+    size_t replayed = 0;
+    bool is_complete = true;
+
+    std::unique_lock<std::mutex> lock(clients_mutex);
+    int waits = 0;
+    while (true) {
+        uint64_t ring_first_seq = g_resume_ring.size() ? g_resume_ring.front().first : g_broadcast_seq + 1;
+        if (replay_after + 1 >= ring_first_seq) {
+            // The rest is in the ring
+            break;
+        }
+        if (replayed >= max_replay) {
+            // Too many missed (the ring moves on faster): the client is told
+            is_complete = false;
+            break;
+        }
+
+        // Not in the ring anymore: read from the store, without the lock
+        // (the ring moves on meanwhile, then the next read continues)
+        lock.unlock();
+        // Note: the newest ones, when more than the limit
+        auto messages = MessageStore::instance().read_after(replay_after, max_replay);
+        bool is_gap_skipped = false;
+        if (messages.empty() || messages.front().id != replay_after + 1) {
+            if (waits < RESUME_STORE_WAITS && messages.size() < max_replay) {
+                // Likely still queued for the store, read it again
+                waits++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                lock.lock();
+                continue;
+            }
+            // Over the limit, dropped by the retention (or not stored)
+            is_complete = false;
+            is_gap_skipped = true;
+            if (messages.empty() || messages.front().id >= ring_first_seq) {
+                replay_after = ring_first_seq - 1;
+            }
+        }
+        for (const auto &stored: messages) {
+            if (stored.id >= ring_first_seq) {
+                break;
+            }
+            if (stored.id != replay_after + 1 && !is_gap_skipped) {
+                // Read again from the gap
+                break;
+            }
+            is_gap_skipped = false;
+            PBMessage message;
+            auto &chat = *message.mutable_chat();
+            *chat.mutable_sent_at() = google::protobuf::util::TimeUtil::NanosecondsToTimestamp(
+                    stored.sent_at.time_since_epoch().count());
+            chat.set_from_user(stored.user_name);
+            chat.set_text(stored.text);
+            chat.set_seq(stored.id);
+            Connection::append_frame(replay_frames, message);
+            replay_after = stored.id;
+            replayed++;
+        }
+        lock.lock();
+    }
+
+    // Under the lock no broadcast can get between the replayed messages
+    std::string frames;
+    append_login_reply(frames, client, g_broadcast_seq);
+    frames += replay_frames;
+    for (const auto &[seq, frame]: g_resume_ring) {
+        if (seq > replay_after) {
+            frames += frame;
+            replayed++;
+        }
+    }
+
+    PBMessage message;
+    prepare_chat_message(*message.mutable_chat());
+    message.mutable_chat()->set_text(std::format("Welcome back {}, {} missed messages{}",
+            login.user_name(), replayed, is_complete ? "" : " (not all of them, see !search)"));
+    Connection::append_frame(frames, message);
+
+    // The write (of up to resume-max-replay messages) is not under the lock,
+    // the broadcasts meanwhile are held for after it
+    client.hold_sends(std::move(frames));
+    lock.unlock();
+
+    Logger::log("[SYSTEM] {}: Resumed after seq {}, {} replayed{}", client.get_user_name(),
+            login.last_seq(), replayed, is_complete ? "" : " (incomplete)");
+    return client.release_sends();
 }
 
 static bool do_login(const PBUserLogin &login, ClientConnection &client) {
+    TRACE_SCOPE("login");
     bool success = client.do_login(login.user_name());
+    g_connections_generation++;
+
+    if (success && login.resume_token().size()) {
+        auto user = client.get_user();
+        if (user->get_resume_token() == login.resume_token()) {
+            success = resume_session(login, client);
+            if (success) {
+                // Direct messages (with the inbox) after the login reply
+                user->add_connection(&client);
+            }
+            return success;
+        }
+        // Invalid token (like after server restart), continue as new login
+    }
 
+    std::string frames;
     PBMessage message;
     prepare_chat_message(*message.mutable_chat());
     if (success) {
         Logger::log("[SYSTEM] {}: Login (is_admin {})", client.get_user_name(), client.is_admin());
 
+        uint64_t last_seq;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            last_seq = g_broadcast_seq;
+        }
+        append_login_reply(frames, client, last_seq);
+
         message.mutable_chat()->set_text(std::format(
                 "Hello {}, Type !help to see avaible commands", login.user_name()));
 
@@ -169,14 +730,19 @@ static bool do_login(const PBUserLogin &login, ClientConnection &client) {
         message.mutable_chat()->set_text(std::format(
                 "Can't login {}", login.user_name()));
     }
+    Connection::append_frame(frames, message);
 
-    if (!client.send_protobuf(message)) {
+    if (!client.send_frames(frames)) {
         success = false;
     }
+    if (success) {
+        // Direct messages (with the inbox) after the login reply
+        client.get_user()->add_connection(&client);
+    }
     return success;
 }
 
-bool broadcast_chat(const PBChatMessage &chat,
+bool broadcast_chat(PBChatMessage &chat,
         ClientConnection &from_client,
         bool suppress_echo=true) {
     Logger::log("[CHAT] {}: {} ", from_client.get_user_name(), chat.text());
@@ -187,35 +753,123 @@ bool broadcast_chat(const PBChatMessage &chat,
     message.mutable_chat()->set_from_user(from_client.get_user_name());
     message.mutable_chat()->set_text(chat.text());
 
+    // Numbering and sending under the lock keeps the order for every client
+    std::unique_lock<std::mutex> lock(clients_mutex, std::defer_lock);
+    {
+        TRACE_SCOPE("clients_mutex wait");
+        lock.lock();
+    }
+    uint64_t seq = g_broadcast_seq + 1;
+    message.mutable_chat()->set_seq(seq);
+
+    // Serialize once for all the clients, the number is used only when sent
+    std::string frame;
+    {
+        TRACE_SCOPE("serialize");
+        if (!Connection::append_frame(frame, message)) {
+            return false;
+        }
+    }
+    g_broadcast_seq = seq;
+    chat.set_seq(seq);
+    if (g_shm_ring) {
+        // Local consumers get the message without the size prefix
+        TRACE_SCOPE("shm ring write");
+        g_shm_ring->write(frame.data() + sizeof(uint32_t), frame.size() - sizeof(uint32_t));
+    }
+
     // Send to all "other" clients (w/o suppress_echo - all clients)
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (auto &client: client_connections) {
-        if (suppress_echo && &client == &from_client) {
-            continue;
+    {
+        TRACE_SCOPE("send_all loop");
+        for (auto &client: client_connections) {
+            if (suppress_echo && &client == &from_client) {
+                continue;
+            }
+            client.send_frames(frame);
         }
-        client.send_protobuf(message);
+    }
+
+    // Keep for replay to resumed sessions
+    g_resume_ring.emplace_back(seq, std::move(frame));
+    while (g_resume_ring.size() > static_cast<size_t>(Config::get(Config::resume_ring_size))) {
+        g_resume_ring.pop_front();
     }
     return true;
 }
 
+static bool start_client_thread(ConnectionList::iterator client_it);
+
+// The connection thread is stopped for the upgrade, it is started again if the
+// upgrade fails (the object and socket are kept)
+static void park_client(ConnectionList::iterator client_it) {
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    if (g_is_upgrading) {
+        g_parked_clients.push_back(client_it);
+        g_clients_cond.notify_all();
+        return;
+    }
+
+    // Failed meanwhile
+    client_it->cancel_hand_over();
+    if (!start_client_thread(client_it)) {
+        client_connections.erase(client_it);
+        g_connections_generation++;
+    }
+}
+
 // Loop to handle specific client
 void client_connection_loop(ConnectionList::iterator client_it) {
     ClientConnection &client = *client_it;
+    // Taken over from the previous server process, or continued after failed upgrade
+    auto user = client.get_user();
+    if (user) {
+        user->add_connection(&client);
+    }
 
-    while (true) {
+    while (client.wait_recv()) {
+        // Tracing decision before the receive, to include it
+        Tracer::instance().sample_message();
         PBMessage message;
-        if (!client.recv_protobuf(message)) {
-            break;
+        {
+            TRACE_SCOPE("recv_protobuf");
+            if (!client.recv_protobuf(message)) {
+                break;
+            }
         }
 
-        if (message.has_chat()) {
-            // Store chat message in user data-base
+        if (message.has_chat() &&
+                message.chat().text().size() > static_cast<size_t>(Config::get(Config::max_message_size))) {
+            PBMessage reply;
+            prepare_chat_message(*reply.mutable_chat());
+            reply.mutable_chat()->set_text(std::format("Message not sent, longer than {} bytes",
+                    Config::get(Config::max_message_size)));
+            client.send_protobuf(reply);
+        }
+        else if (message.has_chat() && !moderate_chat(*message.mutable_chat()->mutable_text(), client)) {
+            PBMessage reply;
+            prepare_chat_message(*reply.mutable_chat());
+            reply.mutable_chat()->set_text(MODERATION_REJECTED);
+            client.send_protobuf(reply);
+        }
+        else if (message.has_chat() && message.chat().to_user().size()) {
+            // Direct message, not stored (private)
+            TRACE_SCOPE("direct chat");
+            auto reply_text = send_direct_chat(message.chat().text(), message.chat().to_user(), client);
+            if (reply_text.size()) {
+                PBMessage reply;
+                prepare_chat_message(*reply.mutable_chat());
+                reply.mutable_chat()->set_text(reply_text);
+                client.send_protobuf(reply);
+            }
+        }
+        else if (message.has_chat()) {
+            // Broadcast (assigns the sequence number), then store in user data-base
+            TRACE_SCOPE("chat");
             PBChatMessage &chat = *message.mutable_chat();
             prepare_chat_message(chat);
-            client.store_chat(chat);
-
-            if (!broadcast_chat(chat, client)) {
-                // TODO: Send chat failed
+            // Not sent is not stored either (no number for the replays)
+            if (broadcast_chat(chat, client)) {
+                client.store_chat(chat);
             }
         }
         else if (message.has_command()) {
@@ -234,7 +888,19 @@ void client_connection_loop(ConnectionList::iterator client_it) {
         }
     }
 
+    Tracer::t_trace_id = 0;
+    // Direct messages go to the inbox from now
+    client.logout();
+    if (client.is_handing_over() && client.get_disconnect_reason().empty() && !client.is_peer_closed()) {
+        // The results of the offloaded commands still go from this process
+        client.drain_offloaded();
+        park_client(client_it);
+        return;
+    }
     std::cout << client << ": disconnected " << client.get_user_name() << std::endl;
+    if (CaptureWriter::instance().is_open()) {
+        CaptureWriter::instance().write(client.get_id(), CAPTURE_CLOSE);
+    }
 
     // Explain why was disconnected
     auto discon_reason = client.get_disconnect_reason();
@@ -247,49 +913,447 @@ void client_connection_loop(ConnectionList::iterator client_it) {
         client.send_protobuf(message);
     }
 
+    // Offloaded commands refer the client object
+    client.drain_offloaded();
+
     auto user_name = client.get_user_name();
     {
         std::lock_guard<std::mutex> lock(clients_mutex);
         client_connections.erase(client_it);
         // Note: client object is no longer valid
+        g_connections_generation++;
+        // The upgrade waits for all the connections
+        g_clients_cond.notify_all();
     }
 
     Logger::log("[SYSTEM] {}: Disconnected", user_name);
 }
 
-// Run server loop
-int server_loop(Connection &server) {
-    Logger::log("[SYSTEM] Server started, port {}", SERVER_PORT);
+// Start detached thread for the client, with the configured stack size
+static bool start_client_thread(ConnectionList::iterator client_it) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, Config::get(Config::thread_stack_size));
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    auto arg = new ConnectionList::iterator(client_it);
+    pthread_t thread;
+    int error = pthread_create(&thread, &attr, [](void *arg) -> void* {
+        auto client_it = *static_cast<ConnectionList::iterator*>(arg);
+        delete static_cast<ConnectionList::iterator*>(arg);
+        client_connection_loop(client_it);
+        return nullptr;
+    }, arg);
+    pthread_attr_destroy(&attr);
+
+    if (error) {
+        std::cerr << *client_it << ": pthread_create() error " << error << std::endl;
+        delete arg;
+        return false;
+    }
+    return true;
+}
+
+// Send the state and the sockets, wait for the new process to confirm
+// (the connection threads are stopped, under clients_mutex)
+static bool send_upgrade_state(Connection &upgrade, const std::vector<Connection*> &servers) {
+    PBMessage message;
+    auto &state = *message.mutable_upgrade();
+    state.set_last_seq(g_broadcast_seq);
+    state.set_server_sockets(servers.size());
+    for (const auto &user: get_all_users()) {
+        user->save_state(*state.add_users());
+    }
+
+    std::vector<int> fds;
+    for (auto server: servers) {
+        fds.push_back(server->get_socket());
+    }
+    for (const auto &client: client_connections) {
+        client.save_state(*state.add_connections());
+        fds.push_back(client.get_socket());
+    }
+
+    PBMessage reply;
+    if (!upgrade.send_protobuf(message) || !upgrade.send_fds(fds) ||
+            !upgrade.recv_protobuf(reply) || !reply.has_result()) {
+        return false;
+    }
+    // Committed: the new process starts the connections on this reply, not sent
+    // (the new process is gone) is rolled back as the other failures.
+    // Remaining window: the reply is sent (or buffered), but the new process dies
+    // before it starts the connections, then both processes are gone
+    for (const auto &line: reply.result().text()) {
+        Logger::log("[SYSTEM] Upgrade: {}", line);
+    }
+    if (!upgrade.send_protobuf(reply)) {
+        return false;
+    }
+    if (g_shm_ring) {
+        g_shm_ring->hand_over();
+    }
+    return true;
+}
+
+// Zero-downtime upgrade, first step: the new server process (started with --upgrade)
+// opens the message store while this one continues, with the compaction stopped
+static std::unique_ptr<Connection> prepare_upgrade(int upgrade_fd) {
+    auto upgrade = std::make_unique<Connection>(upgrade_fd);
+    // The sockets are for the same user only
+    ucred peer{};
+    socklen_t peer_len = sizeof(peer);
+    if (getsockopt(upgrade_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) < 0 || peer.uid != getuid()) {
+        Logger::log("[SYSTEM] Upgrade refused, process {} of uid {}", peer.pid, peer.uid);
+        return nullptr;
+    }
+    upgrade->set_recv_timeout(UPGRADE_TIMEOUT);
+    Logger::log("[SYSTEM] Upgrade: process {} opens the message store", peer.pid);
+
+    // No segments are merged or removed meanwhile, only appended to
+    MessageStore::instance().stop_compaction();
+    PBMessage message;
+    message.mutable_result()->set_command("upgrade");
+    message.mutable_result()->add_text(std::format("Compaction stopped by process {}", getpid()));
+    if (!upgrade->send_protobuf(message)) {
+        MessageStore::instance().start_compaction();
+        return nullptr;
+    }
+    return upgrade;
+}
+
+// Then hand the listening sockets and the connections with their state over,
+// when the new process requests them (or restart the compaction, when it gave up)
+// Returns true when handed over, this process is to exit
+static bool hand_over_clients(std::unique_ptr<Connection> upgrade, const std::vector<Connection*> &servers) {
+    auto started_at = std::chrono::steady_clock::now();
+    bool is_handed_over = false;
+    std::unique_lock<std::mutex> lock(clients_mutex, std::defer_lock);
+    PBMessage request;
+    if (upgrade->recv_protobuf(request) && request.has_result()) {
+        for (const auto &line: request.result().text()) {
+            Logger::log("[SYSTEM] Upgrade: {}", line);
+        }
+
+        // Each connection thread stops before the next frame, or keeps the partial one
+        lock.lock();
+        g_is_upgrading = true;
+        for (auto &client: client_connections) {
+            client.hand_over();
+        }
+        bool is_stopped = g_clients_cond.wait_for(lock, std::chrono::seconds(UPGRADE_TIMEOUT), [] {
+            return g_parked_clients.size() == client_connections.size();
+        });
+
+        if (is_stopped) {
+            // All the received messages are stored, the new process catches them up
+            TaskPool::instance().wait_idle();
+            is_handed_over = send_upgrade_state(*upgrade, servers);
+        }
+    }
+    // Closed before the connections continue here: the new process sees it
+    upgrade.reset();
+
+    if (is_handed_over) {
+        Logger::log("[SYSTEM] Upgrade: {} connections handed over in {}", client_connections.size(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started_at));
+        return true;
+    }
+
+    MessageStore::instance().start_compaction();
+    if (!lock.owns_lock()) {
+        Logger::log("[SYSTEM] Upgrade cancelled by the new process");
+        return false;
+    }
+    g_is_upgrading = false;
+    for (auto &client: client_connections) {
+        client.cancel_hand_over();
+    }
+    // The stopped ones start again, the others continue (or restart in park_client)
+    for (auto client_it: g_parked_clients) {
+        if (!start_client_thread(client_it)) {
+            client_connections.erase(client_it);
+            g_connections_generation++;
+        }
+    }
+    g_parked_clients.clear();
+    Logger::log("[SYSTEM] Upgrade failed, continue with {} connections", client_connections.size());
+    return false;
+}
+
+// Run server loop, accept clients from all the listening sockets,
+// and the new server process on the upgrade socket
+int server_loop(const std::vector<Connection*> &servers, Connection &upgrade_server) {
+    Logger::log("[SYSTEM] Server started, port {}", Config::get(Config::port));
+
+    std::vector<pollfd> fds;
+    for (auto server: servers) {
+        fds.push_back(pollfd{.fd = server->get_socket(), .events = POLLIN});
+    }
+    fds.push_back(pollfd{.fd = upgrade_server.get_socket(), .events = POLLIN});
+    // The new server process opening the message store (ignored while -1)
+    std::unique_ptr<Connection> upgrade;
+    fds.push_back(pollfd{.fd = -1, .events = POLLIN});
 
     while (g_server_running) {
-        int client_fd = server.accept();
-        ConnectionList::iterator client_it;
-        {
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            // Construct ClientConnection object in-place using client_fd
-            client_connections.emplace_back(client_fd);
-            client_it = std::prev(client_connections.end());
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "poll() error " << errno << std::endl;
+            break;
+        }
+
+        if (upgrade && fds.back().revents) {
+            // Requested (store opened) or closed
+            // The upgrade socket too, it is not created again meanwhile
+            auto listeners = servers;
+            listeners.push_back(&upgrade_server);
+            if (hand_over_clients(std::move(upgrade), listeners)) {
+                break;
+            }
+            fds.back().fd = -1;
+        }
+        if (fds[servers.size()].revents) {
+            int upgrade_fd = upgrade_server.accept();
+            if (upgrade_fd >= 0 && upgrade) {
+                Logger::log("[SYSTEM] Upgrade refused, another one is in progress");
+                close(upgrade_fd);
+            }
+            else if (upgrade_fd >= 0) {
+                upgrade = prepare_upgrade(upgrade_fd);
+                fds.back().fd = upgrade ? upgrade->get_socket() : -1;
+            }
         }
 
-        std::thread(client_connection_loop, client_it).detach();
+        for (size_t i = 0; i < servers.size(); i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            int client_fd = servers[i]->accept();
+            if (client_fd < 0) {
+                std::cerr << *servers[i] << ": accept() error " << errno << std::endl;
+                continue;
+            }
+
+            ConnectionList::iterator client_it;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                // Construct ClientConnection object in-place using client_fd
+                client_connections.emplace_back(client_fd);
+                client_it = std::prev(client_connections.end());
+                g_connections_generation++;
+            }
+            if (CaptureWriter::instance().is_open()) {
+                CaptureWriter::instance().write(client_it->get_id(), CAPTURE_OPEN);
+            }
+
+            if (!start_client_thread(client_it)) {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                client_connections.erase(client_it);
+                g_connections_generation++;
+            }
+        }
     }
 
     Logger::log("[SYSTEM] Server stopped");
     return 0;
 }
 
-int main() {
-    std::cout << "Start server application on port " << SERVER_PORT << std::endl;
+// Wait for the running server to stop its compaction (upgrade), before the store is opened
+static bool wait_upgrade_store(Connection &upgrade) {
+    PBMessage reply;
+    return upgrade.recv_protobuf(reply) && reply.has_result();
+}
+
+// Request the state and the sockets of the running server (upgrade), the store is opened
+static bool receive_upgrade_state(Connection &upgrade, PBUpgradeState &state, std::vector<int> &fds) {
+    PBMessage request, message;
+    request.mutable_result()->set_command("upgrade");
+    request.mutable_result()->add_text(std::format("Message store opened by process {}, {} messages",
+            getpid(), MessageStore::instance().get_message_count()));
+    if (!upgrade.send_protobuf(request) || !upgrade.recv_protobuf(message) || !message.has_upgrade()) {
+        return false;
+    }
+    state.Swap(message.mutable_upgrade());
+    // TCP, Unix domain and upgrade listening sockets, then the connections
+    return state.server_sockets() == 3 &&
+            upgrade.recv_fds(fds, state.server_sockets() + state.connections_size());
+}
 
-    // Create/bind server socket
-    int server_fd = create_server_socket(SERVER_PORT, MAX_CLIENTS);
-    if (server_fd < 0) {
+// Confirm the upgrade, then continue the connections of the previous process
+static bool take_over_clients(Connection &upgrade, const PBUpgradeState &state, const std::vector<int> &fds) {
+    // The previous process commits to exit by the reply, or closes the socket
+    PBMessage message, reply;
+    message.mutable_result()->set_command("upgrade");
+    message.mutable_result()->add_text(std::format("{} connections and {} users taken over by process {}",
+            state.connections_size(), state.users_size(), getpid()));
+    if (!upgrade.send_protobuf(message) || !upgrade.recv_protobuf(reply) || !reply.has_result()) {
+        return false;
+    }
+
+    // Continue its ring, the consumers keep reading
+    if (g_shm_ring && !g_shm_ring->take_over(SHM_RING_NAME)) {
+        g_shm_ring = std::make_unique<ShmRing>();
+        if (!g_shm_ring->create(SHM_RING_NAME, Config::get(Config::shm_ring_size))) {
+            g_shm_ring.reset();
+        }
+    }
+
+    // Users first, the connections are logged in
+    for (const auto &user: state.users()) {
+        find_user(user.name(), true)->restore_state(user);
+    }
+    // All of them before any one continues, the first messages are broadcast to all
+    std::vector<ConnectionList::iterator> client_its;
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (int i = 0; i < state.connections_size(); i++) {
+            client_connections.emplace_back(fds[state.server_sockets() + i]);
+            client_its.push_back(std::prev(client_connections.end()));
+            client_its.back()->restore_state(state.connections(i));
+        }
+        g_connections_generation++;
+    }
+    for (auto client_it: client_its) {
+        if (!start_client_thread(client_it)) {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            client_connections.erase(client_it);
+            g_connections_generation++;
+        }
+    }
+    Logger::log("[SYSTEM] Upgrade: {} connections taken over", state.connections_size());
+    return true;
+}
+
+// Reload the config on SIGHUP (blocked in all the other threads)
+static void signal_loop(sigset_t signals) {
+    while (g_server_running) {
+        // Wake up meanwhile, to flush the log lines kept by log-flush-interval
+        auto period = std::clamp<int64_t>(Config::get(Config::log_flush_interval),
+                SIGNAL_WAIT_MIN_MS, SIGNAL_WAIT_MAX_MS);
+        timespec timeout{.tv_sec = period / 1000, .tv_nsec = period % 1000 * 1000000};
+        if (sigtimedwait(&signals, nullptr, &timeout) == SIGHUP) {
+            reload_config();
+        }
+        Logger::flush_idle();
+    }
+}
+
+int main(int argc, char **argv) {
+    // Block SIGHUP before any thread is started, the threads inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    if (!Config::instance().load(argc, argv)) {
         return 255;
     }
+    apply_config();
+    std::vector<std::string> moderation_report;
+    bool is_moderation_loaded = ModerationFilter::instance().load(
+            Config::get_string(Config::moderation_file), moderation_report);
+    for (const auto &line: moderation_report) {
+        (is_moderation_loaded ? std::cout : std::cerr) << line << std::endl;
+    }
+    if (!is_moderation_loaded) {
+        return 255;
+    }
+    std::thread(signal_loop, signals).detach();
+
+    auto port = Config::get(Config::port);
+    std::cout << "Start server application on port " << port << std::endl;
+
+    if (Config::get(Config::shm_ring)) {
+        // Publish all broadcasts to local shared memory consumers
+        // Upgrade: the ring of the previous process is taken over with the clients
+        g_shm_ring = std::make_unique<ShmRing>();
+        if (!Config::get(Config::upgrade) &&
+                !g_shm_ring->create(SHM_RING_NAME, Config::get(Config::shm_ring_size))) {
+            return 255;
+        }
+        std::cout << "Broadcast shared memory ring: " << SHM_RING_NAME << std::endl;
+    }
+
+    // Record the traffic, for chat_replay
+    const auto &capture_file = Config::get_string(Config::capture_file);
+    if (capture_file.size()) {
+        if (!CaptureWriter::instance().open(capture_file)) {
+            return 255;
+        }
+        std::cout << "Capture file: " << capture_file << std::endl;
+    }
+
+    // Listening sockets: TCP, Unix domain for the local clients (bots can avoid the
+    // TCP overhead) and the one the next version takes over by --upgrade.
+    // Created before the message store is opened, not while another server uses it
+    const auto &unix_socket = Config::get_string(Config::unix_socket);
+    const auto &upgrade_socket = Config::get_string(Config::upgrade_socket);
+    bool is_upgrade = Config::get(Config::upgrade);
+    int server_fd = -1, unix_server_fd = -1, upgrade_server_fd = -1;
+    if (!is_upgrade) {
+        server_fd = create_server_socket(port, Config::get(Config::max_clients));
+        if (server_fd < 0) {
+            return 255;
+        }
+        unix_server_fd = create_unix_server_socket(unix_socket, Config::get(Config::max_clients));
+        if (unix_server_fd < 0) {
+            return 255;
+        }
+        upgrade_server_fd = create_unix_server_socket(upgrade_socket, 1);
+        if (upgrade_server_fd < 0) {
+            return 255;
+        }
+    }
+
+    // Zero-downtime upgrade: the running server keeps serving while this process
+    // opens the message store, then hands the listening sockets and the connections
+    // over, only the messages stored meanwhile are to be loaded
+    Connection upgrade(is_upgrade ? connect_to_unix_server(upgrade_socket) : 0);
+    if (is_upgrade && (upgrade.get_socket() < 0 || !wait_upgrade_store(upgrade))) {
+        std::cerr << "Upgrade from " << upgrade_socket << " failed" << std::endl;
+        return 255;
+    }
+
+    // Load persistent messages (rebuilds the search indexes)
+    if (!MessageStore::instance().open(Config::get_string(Config::store_dir), is_upgrade)) {
+        return 255;
+    }
+    std::cout << "Message store: " << MessageStore::instance().get_message_count() << " messages in "
+            << MessageStore::instance().get_segment_count() << " segments" << std::endl;
+
+    PBUpgradeState upgrade_state;
+    std::vector<int> upgrade_fds;
+    if (is_upgrade) {
+        if (!receive_upgrade_state(upgrade, upgrade_state, upgrade_fds) ||
+                !MessageStore::instance().catch_up()) {
+            std::cerr << "Upgrade from " << upgrade_socket << " failed" << std::endl;
+            return 255;
+        }
+        std::cout << "Upgrade: " << upgrade_state.connections_size() << " connections from "
+                << upgrade_socket << std::endl;
+        server_fd = upgrade_fds[0];
+        unix_server_fd = upgrade_fds[1];
+        upgrade_server_fd = upgrade_fds[2];
+    }
     Connection server(server_fd);
+    Connection unix_server(unix_server_fd);
+    Connection upgrade_server(upgrade_server_fd);
+    std::cout << "Local clients socket: " << unix_socket << std::endl;
+
+    // Continue the sequence numbers of the stored messages
+    g_broadcast_seq = MessageStore::instance().get_last_id();
+    if (is_upgrade) {
+        g_broadcast_seq = std::max(g_broadcast_seq, upgrade_state.last_seq());
+        if (!take_over_clients(upgrade, upgrade_state, upgrade_fds)) {
+            std::cerr << "Upgrade from " << upgrade_socket << " not confirmed" << std::endl;
+            return 255;
+        }
+    }
+    MessageStore::instance().start_compaction();
 
     // Run the main loop
-    int ret = server_loop(server);
+    int ret = server_loop({&server, &unix_server}, upgrade_server);
 
     return ret;
 }
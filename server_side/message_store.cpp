@@ -0,0 +1,1375 @@
+/*
+ * MessageStore class implementation
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <array>
+#include <map>
+#include <memory>
+#include <vector>
+#include <span>
+#include <unordered_map>
+#include <algorithm>
+#include <filesystem>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <zlib.h>
+
+#include "message_store.h"
+#include "search_index.h"
+#include "config.h"
+
+
+#define SEGMENT_FILENAME_FMT    "{}/{}.seg"
+#define SEGMENT_FILE_EXT        ".seg"
+#define COLD_FILENAME_FMT       "{}/{}.cold"
+#define COLD_FILE_EXT           ".cold"
+// Search index and message table of a cold segment, next to it
+#define INDEX_FILE_EXT          ".idx"
+// Cold segment or index being written, removed when left by a crash
+#define TEMP_FILE_EXT           ".tmp"
+
+// Records are compressed in blocks, a read decompresses a single block
+#define COLD_BLOCK_SIZE         (64 * 1024)
+#define COLD_COMPRESS_LEVEL     6
+#define COLD_MAGIC              "CHATCLD1"
+#define INDEX_MAGIC             "CHATIDX1"
+// Rewrite a cold segment when 1/N of its messages are out of per-user retention
+#define COLD_DEAD_RATIO         4
+// Check the compaction I/O rate after this many bytes
+#define THROTTLE_CHECK_BYTES    (64 * 1024)
+
+// Linux I/O priority (no glibc wrapper): compaction in the idle class
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+
+/*
+ * Segment record layout (host byte order):
+ *  u32 size of the rest of record
+ *  u64 message id
+ *  i64 sent at, nanoseconds since epoch
+ *  u16 user name length
+ *  user name, then text bytes
+ *
+ * Cold segment layout: ColdHeader, then blocks of BlockHeader and zlib
+ * compressed records (whole records only)
+ *
+ * Cold segment index layout: IndexHeader, u64 location of each message, u64
+ * id of each message, u64 file offset and BlockHeader of each block, user
+ * counts (u32 count, u16 name length, name) padded to 8 bytes, then the
+ * saved SearchIndex
+ */
+#pragma pack(push, 1)
+struct RecordHeader {
+    uint32_t size;
+    uint64_t id;
+    int64_t sent_at_ns;
+    uint16_t user_len;
+};
+
+struct ColdHeader {
+    char magic[8];
+    // Start of the newest merged hot segment (older hot segments are duplicates)
+    int64_t last_start;
+};
+
+struct BlockHeader {
+    uint32_t size;
+    uint32_t raw_size;
+};
+
+struct IndexHeader {
+    char magic[8];
+    // The cold file indexed, a rewrite replaces it (another inode)
+    uint64_t cold_inode;
+    uint64_t cold_size;
+    int64_t cold_mtime_ns;
+    uint64_t message_count;
+    uint64_t block_count;
+    uint64_t users_size;
+    uint64_t search_size;
+    uint64_t max_id;
+    uint64_t raw_size;
+    int64_t first_sent_at_ns;
+    int64_t last_sent_at_ns;
+};
+
+struct UserCount {
+    uint32_t count;
+    uint16_t name_len;
+};
+#pragma pack(pop)
+
+// Record with header from data at offset, false when incomplete
+static bool parse_record(std::string_view data, size_t offset, RecordHeader &header, std::string_view &record) {
+    if (data.size() - offset < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data.data() + offset, sizeof(header));
+    size_t record_len = header.size + sizeof(header.size);
+    if (record_len < sizeof(header) || header.user_len > record_len - sizeof(header) ||
+            data.size() - offset < record_len) {
+        return false;
+    }
+    record = data.substr(offset, record_len);
+    return true;
+}
+
+static bool decompress(const BlockHeader &header, std::string_view data, std::string &raw) {
+    raw.resize(header.raw_size);
+    uLongf raw_len = raw.size();
+    return uncompress(reinterpret_cast<Bytef*>(raw.data()), &raw_len,
+            reinterpret_cast<const Bytef*>(data.data()), data.size()) == Z_OK && raw_len == raw.size();
+}
+
+// Complete records of a hot segment file from offset, up to end (zero is all)
+static bool scan_records(const std::string &path, uint64_t offset, uint64_t end,
+        const std::function<bool(const RecordHeader &header, std::string_view record)> &callback) {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(offset);
+    std::string record;
+    RecordHeader header;
+    for (uint64_t done = offset; (end == 0 || done < end) &&
+            file.read(reinterpret_cast<char*>(&header), sizeof(header)); ) {
+        size_t record_len = header.size + sizeof(header.size);
+        if (record_len < sizeof(header) || header.user_len > record_len - sizeof(header)) {
+            break;
+        }
+        record.resize(record_len);
+        memcpy(record.data(), &header, sizeof(header));
+        if (!file.read(record.data() + sizeof(header), record_len - sizeof(header))) {
+            break;
+        }
+        if (!callback(header, record)) {
+            return false;
+        }
+        done += record_len;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t bytes = write(fd, static_cast<const char*>(data) + done, len - done);
+        if (bytes < 0) {
+            return false;
+        }
+        done += bytes;
+    }
+    return true;
+}
+
+// Through a temporary file, the old one is replaced only by a complete one
+static bool write_file(const std::string &path, std::string_view data) {
+    auto temp_path = path + TEMP_FILE_EXT;
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Can't create " << temp_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool is_written = write_all(fd, data.data(), data.size()) && fdatasync(fd) == 0;
+    close(fd);
+    if (!is_written || rename(temp_path.c_str(), path.c_str()) < 0) {
+        std::cerr << "Can't write " << path << ": " << strerror(errno) << std::endl;
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Limits the compaction I/O rate, sleeps when ahead
+class IoThrottle {
+    const uint64_t m_rate;
+    const std::chrono::steady_clock::time_point m_start;
+    uint64_t m_bytes = 0;
+    uint64_t m_checked = 0;
+
+public:
+    IoThrottle(uint64_t rate) : m_rate(rate), m_start(std::chrono::steady_clock::now()) {}
+
+    void add(size_t bytes) {
+        m_bytes += bytes;
+        if (m_bytes - m_checked < THROTTLE_CHECK_BYTES) {
+            return;
+        }
+        m_checked = m_bytes;
+        auto due = m_start + std::chrono::microseconds(m_bytes * 1000000 / m_rate);
+        if (due > std::chrono::steady_clock::now()) {
+            std::this_thread::sleep_until(due);
+        }
+    }
+};
+
+class MessageStore::Segment {
+    std::mutex m_mutex;
+    int m_fd = -1;
+    // File size and uncompressed size (the same for hot segments)
+    uint64_t m_size = 0;
+    uint64_t m_raw_size = 0;
+    // Location and id of each message, index by segment local message number
+    // (hot: file offset, cold: block number << 32 | offset in the block)
+    std::vector<uint64_t> m_offsets;
+    std::vector<uint64_t> m_ids;
+    // Cold: the same and the search index, in the mapped index file (or in
+    // m_index_data when it can't be written), never changed after load
+    void *m_map = nullptr;
+    size_t m_map_size = 0;
+    std::string m_index_data;
+    std::span<const uint64_t> m_cold_offsets;
+    std::span<const uint64_t> m_cold_ids;
+    std::string_view m_saved_index;
+    TimePoint m_first_sent_at = TimePoint::max();
+    TimePoint m_last_sent_at{};
+    SearchIndex m_index;
+    // For the per-user retention
+    std::unordered_map<std::string, uint32_t> m_user_counts;
+    // Being compacted or dropped, no more appends
+    bool m_is_sealed = false;
+
+    // Cold: file offset of each block, the last one read is cached
+    struct Block {
+        uint64_t offset;
+        BlockHeader header;
+    };
+    std::vector<Block> m_blocks;
+    mutable std::mutex m_cache_mutex;
+    mutable size_t m_cached_block = SIZE_MAX;
+    mutable std::shared_ptr<const std::string> m_cached_data;
+
+    void add_record(const RecordHeader &header, std::string_view record, uint64_t location);
+    std::shared_ptr<const std::string> read_block(size_t block) const;
+    bool load_hot(uint64_t &max_id, bool is_shared);
+    bool load_cold(uint64_t &max_id);
+    // Cold index file data, false when damaged or of another file
+    bool use_index(std::string_view data, const struct stat &cold_stat, uint64_t &max_id);
+    bool map_index(const struct stat &cold_stat, uint64_t &max_id);
+    std::string make_index(const struct stat &cold_stat, uint64_t max_id) const;
+
+    // Hot ones grow under the lock
+    std::span<const uint64_t> get_offsets() const {
+        return m_is_cold ? m_cold_offsets : std::span<const uint64_t>(m_offsets);
+    }
+    std::span<const uint64_t> get_ids() const {
+        return m_is_cold ? m_cold_ids : std::span<const uint64_t>(m_ids);
+    }
+
+public:
+    const std::string m_path;
+    // Start of the time period, seconds since epoch
+    const int64_t m_start;
+    const bool m_is_cold;
+    // Cold: see ColdHeader
+    int64_t m_last_start = 0;
+
+    Segment(const std::string &path, int64_t start, bool is_cold = false) :
+        m_path(path), m_start(start), m_is_cold(is_cold) {}
+    ~Segment() {
+        if (m_fd >= 0) {
+            close(m_fd);
+        }
+        if (m_map) {
+            munmap(m_map, m_map_size);
+        }
+    }
+
+    std::string get_index_path() const {
+        return std::filesystem::path(m_path).replace_extension(INDEX_FILE_EXT).string();
+    }
+
+    // Shared: another process still appends (upgrade), incomplete end is kept
+    bool load(uint64_t &max_id, bool is_shared = false);
+    // Hot: index the records appended by the other process since load
+    bool catch_up(uint64_t &max_id);
+    bool append(uint64_t id, const TimePoint &sent_at, const std::string &user_name,
+            const std::string &text);
+    bool read(uint64_t location, StoredMessage &message) const;
+    void search(const std::vector<std::string> &terms, const TimePoint &since,
+            size_t limit, std::vector<StoredMessage> &results);
+    // Returns false when older segments can't have such messages
+    bool read_after(uint64_t after_id, size_t limit, std::vector<StoredMessage> &results);
+
+    // Each record (with header), oldest first, stops when callback returns false
+    bool scan(const std::function<bool(const RecordHeader &header, std::string_view record)> &callback);
+    // Cold: the compressed blocks, as they are in the file
+    bool scan_blocks(const std::function<bool(const BlockHeader &header, std::string_view data)> &callback);
+    void seal() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_is_sealed = true;
+    }
+
+    size_t get_message_count() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return get_offsets().size();
+    }
+    TimePoint get_first_sent_at() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_first_sent_at;
+    }
+    TimePoint get_last_sent_at() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_last_sent_at;
+    }
+    uint64_t get_size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_size;
+    }
+    uint64_t get_raw_size() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_raw_size;
+    }
+    std::unordered_map<std::string, uint32_t> get_user_counts() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_user_counts;
+    }
+};
+
+void MessageStore::Segment::add_record(const RecordHeader &header, std::string_view record, uint64_t location) {
+    std::string_view user_name = record.substr(sizeof(header), header.user_len);
+    std::string_view text = record.substr(sizeof(header) + header.user_len);
+    TimePoint sent_at{std::chrono::nanoseconds(header.sent_at_ns)};
+
+    m_index.add(m_offsets.size(), user_name, text);
+    m_offsets.push_back(location);
+    m_ids.push_back(header.id);
+    m_raw_size += record.size();
+    m_first_sent_at = std::min(m_first_sent_at, sent_at);
+    m_last_sent_at = std::max(m_last_sent_at, sent_at);
+    m_user_counts[std::string(user_name)]++;
+}
+
+bool MessageStore::Segment::load(uint64_t &max_id, bool is_shared) {
+    m_fd = m_is_cold ?
+            ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC) :
+            ::open(m_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        std::cerr << "Can't open " << m_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return m_is_cold ? load_cold(max_id) : load_hot(max_id, is_shared);
+}
+
+bool MessageStore::Segment::catch_up(uint64_t &max_id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_is_cold || load_hot(max_id, false);
+}
+
+bool MessageStore::Segment::load_hot(uint64_t &max_id, bool is_shared) {
+    // Rebuild offsets and search index, after the loaded records when catching up
+    scan_records(m_path, m_size, 0, [&](const RecordHeader &header, std::string_view record) {
+        add_record(header, record, m_size);
+        m_size += record.size();
+        max_id = std::max(max_id, header.id);
+        return true;
+    });
+
+    // Drop incomplete record at the end (crash while writing), unless being written
+    if (!is_shared && std::filesystem::file_size(m_path) != m_size) {
+        std::cerr << m_path << ": truncated to " << m_size << " bytes" << std::endl;
+        if (ftruncate(m_fd, m_size) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MessageStore::Segment::load_cold(uint64_t &max_id) {
+    ColdHeader header;
+    if (pread(m_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, COLD_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << m_path << ": not a cold segment" << std::endl;
+        return false;
+    }
+    m_last_start = header.last_start;
+    struct stat cold_stat;
+    if (fstat(m_fd, &cold_stat) < 0) {
+        std::cerr << "Can't stat " << m_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Written by the compaction with the segment, rebuilt when missing or stale
+    if (map_index(cold_stat, max_id)) {
+        return true;
+    }
+
+    // Decompress each block once, to rebuild the search index
+    uint64_t index_max_id = 0;
+    m_size = sizeof(header);
+    std::string raw;
+    bool is_complete = scan_blocks([&](const BlockHeader &block_header, std::string_view data) {
+        if (!decompress(block_header, data, raw)) {
+            return false;
+        }
+        uint64_t block = m_blocks.size();
+        m_blocks.push_back(Block{m_size, block_header});
+        m_size += sizeof(block_header) + data.size();
+
+        RecordHeader record_header;
+        std::string_view record;
+        for (size_t offset = 0; parse_record(raw, offset, record_header, record); offset += record.size()) {
+            add_record(record_header, record, block << 32 | offset);
+            index_max_id = std::max(index_max_id, record_header.id);
+        }
+        return true;
+    });
+    size_t message_count = m_offsets.size();
+    auto data = make_index(cold_stat, index_max_id);
+    m_offsets = {};
+    m_ids = {};
+    m_index = {};
+    m_blocks.clear();
+    m_user_counts.clear();
+    if (!is_complete) {
+        // Written to a temporary file first, only a disk error can do this
+        // (not saved, reported on each load)
+        std::cerr << m_path << ": damaged block, " << message_count << " messages loaded" << std::endl;
+    }
+    else if (write_file(get_index_path(), data) && map_index(cold_stat, max_id)) {
+        return true;
+    }
+    // Kept in memory
+    m_index_data = std::move(data);
+    return use_index(m_index_data, cold_stat, max_id);
+}
+
+bool MessageStore::Segment::use_index(std::string_view data, const struct stat &cold_stat, uint64_t &max_id) {
+    IndexHeader header;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+            header.cold_inode != static_cast<uint64_t>(cold_stat.st_ino) ||
+            header.cold_size != static_cast<uint64_t>(cold_stat.st_size) ||
+            header.cold_mtime_ns != cold_stat.st_mtim.tv_sec * 1000000000LL + cold_stat.st_mtim.tv_nsec) {
+        return false;
+    }
+
+    // Each part within the data (no overflow), in this order
+    size_t rest = data.size() - sizeof(header);
+    if (header.message_count > rest / (2 * sizeof(uint64_t))) {
+        return false;
+    }
+    rest -= header.message_count * 2 * sizeof(uint64_t);
+    if (header.block_count > rest / sizeof(Block)) {
+        return false;
+    }
+    rest -= header.block_count * sizeof(Block);
+    uint64_t users_padded = (header.users_size + 7) & ~uint64_t(7);
+    if (header.users_size > rest || users_padded > rest || header.search_size != rest - users_padded) {
+        return false;
+    }
+
+    const char *pos = data.data() + sizeof(header);
+    std::span<const uint64_t> offsets(reinterpret_cast<const uint64_t*>(pos), header.message_count);
+    std::span<const uint64_t> ids(offsets.data() + header.message_count, header.message_count);
+    pos += header.message_count * 2 * sizeof(uint64_t);
+    std::vector<Block> blocks(header.block_count);
+    memcpy(blocks.data(), pos, header.block_count * sizeof(Block));
+    pos += header.block_count * sizeof(Block);
+
+    std::string_view users(pos, header.users_size);
+    std::unordered_map<std::string, uint32_t> user_counts;
+    for (size_t offset = 0; offset < users.size(); ) {
+        UserCount user;
+        if (users.size() - offset < sizeof(user)) {
+            return false;
+        }
+        memcpy(&user, users.data() + offset, sizeof(user));
+        offset += sizeof(user);
+        if (users.size() - offset < user.name_len) {
+            return false;
+        }
+        user_counts[std::string(users.substr(offset, user.name_len))] = user.count;
+        offset += user.name_len;
+    }
+
+    m_cold_offsets = offsets;
+    m_cold_ids = ids;
+    m_blocks = std::move(blocks);
+    m_user_counts = std::move(user_counts);
+    m_saved_index = data.substr(data.size() - header.search_size);
+    m_size = header.cold_size;
+    m_raw_size = header.raw_size;
+    m_first_sent_at = TimePoint{std::chrono::nanoseconds(header.first_sent_at_ns)};
+    m_last_sent_at = TimePoint{std::chrono::nanoseconds(header.last_sent_at_ns)};
+    max_id = std::max(max_id, header.max_id);
+    return true;
+}
+
+bool MessageStore::Segment::map_index(const struct stat &cold_stat, uint64_t &max_id) {
+    int fd = ::open(get_index_path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    // Paged in by the searches, not kept in the process memory
+    struct stat index_stat;
+    void *map = fstat(fd, &index_stat) == 0 && index_stat.st_size > 0 ?
+            mmap(nullptr, index_stat.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (!use_index(std::string_view(static_cast<const char*>(map), index_stat.st_size), cold_stat, max_id)) {
+        munmap(map, index_stat.st_size);
+        return false;
+    }
+    m_map = map;
+    m_map_size = index_stat.st_size;
+    return true;
+}
+
+std::string MessageStore::Segment::make_index(const struct stat &cold_stat, uint64_t max_id) const {
+    std::string users;
+    for (const auto &[user_name, count]: m_user_counts) {
+        UserCount user{count, static_cast<uint16_t>(user_name.size())};
+        users.append(reinterpret_cast<const char*>(&user), sizeof(user));
+        users += user_name;
+    }
+    size_t users_size = users.size();
+    users.resize((users_size + 7) & ~size_t(7));
+
+    std::string search;
+    m_index.save(search);
+    IndexHeader header{
+        .cold_inode = static_cast<uint64_t>(cold_stat.st_ino),
+        .cold_size = static_cast<uint64_t>(cold_stat.st_size),
+        .cold_mtime_ns = cold_stat.st_mtim.tv_sec * 1000000000LL + cold_stat.st_mtim.tv_nsec,
+        .message_count = m_offsets.size(),
+        .block_count = m_blocks.size(),
+        .users_size = users_size,
+        .search_size = search.size(),
+        .max_id = max_id,
+        .raw_size = m_raw_size,
+        .first_sent_at_ns = m_first_sent_at.time_since_epoch().count(),
+        .last_sent_at_ns = m_last_sent_at.time_since_epoch().count(),
+    };
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+
+    std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data.append(reinterpret_cast<const char*>(m_offsets.data()), m_offsets.size() * sizeof(uint64_t));
+    data.append(reinterpret_cast<const char*>(m_ids.data()), m_ids.size() * sizeof(uint64_t));
+    data.append(reinterpret_cast<const char*>(m_blocks.data()), m_blocks.size() * sizeof(Block));
+    data += users;
+    data += search;
+    return data;
+}
+
+bool MessageStore::Segment::scan(const std::function<bool(const RecordHeader &header, std::string_view record)> &callback) {
+    if (m_is_cold) {
+        std::string raw;
+        return scan_blocks([&](const BlockHeader &block_header, std::string_view data) {
+            if (!decompress(block_header, data, raw)) {
+                return false;
+            }
+            RecordHeader header;
+            std::string_view record;
+            for (size_t offset = 0; parse_record(raw, offset, header, record); offset += record.size()) {
+                if (!callback(header, record)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    // Up to the last complete record (appends may follow)
+    uint64_t size;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size = m_size;
+    }
+    return scan_records(m_path, 0, size, callback);
+}
+
+bool MessageStore::Segment::scan_blocks(const std::function<bool(const BlockHeader &header, std::string_view data)> &callback) {
+    std::ifstream file(m_path, std::ios::binary);
+    file.seekg(sizeof(ColdHeader));
+    std::string data;
+    BlockHeader header;
+    while (file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        data.resize(header.size);
+        if (!file.read(data.data(), data.size()) || !callback(header, data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MessageStore::Segment::append(uint64_t id, const TimePoint &sent_at,
+        const std::string &user_name, const std::string &text) {
+    RecordHeader header{
+        .size = static_cast<uint32_t>(sizeof(header) - sizeof(header.size) + user_name.size() + text.size()),
+        .id = id,
+        .sent_at_ns = sent_at.time_since_epoch().count(),
+        .user_len = static_cast<uint16_t>(user_name.size()),
+    };
+    std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record += user_name;
+    record += text;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd < 0 || m_is_cold || m_is_sealed) {
+        return false;
+    }
+    if (!write_all(m_fd, record.data(), record.size())) {
+        std::cerr << m_path << ": write error " << errno << std::endl;
+        return false;
+    }
+
+    add_record(header, record, m_size);
+    m_size += record.size();
+    return true;
+}
+
+std::shared_ptr<const std::string> MessageStore::Segment::read_block(size_t block) const {
+    {
+        std::lock_guard<std::mutex> lock(m_cache_mutex);
+        if (m_cached_block == block) {
+            return m_cached_data;
+        }
+    }
+
+    // Blocks are never changed after load
+    const auto &info = m_blocks[block];
+    std::string data(info.header.size, '\0');
+    if (pread(m_fd, data.data(), data.size(), info.offset + sizeof(BlockHeader)) !=
+            static_cast<ssize_t>(data.size())) {
+        return nullptr;
+    }
+    auto raw = std::make_shared<std::string>();
+    if (!decompress(info.header, data, *raw)) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(m_cache_mutex);
+    m_cached_block = block;
+    m_cached_data = raw;
+    return raw;
+}
+
+bool MessageStore::Segment::read(uint64_t location, StoredMessage &message) const {
+    RecordHeader header;
+    std::string body;
+    if (m_is_cold) {
+        auto raw = read_block(location >> 32);
+        std::string_view record;
+        if (raw == nullptr || !parse_record(*raw, location & 0xffffffff, header, record)) {
+            return false;
+        }
+        body = record.substr(sizeof(header));
+    }
+    else {
+        if (pread(m_fd, &header, sizeof(header), location) != sizeof(header)) {
+            return false;
+        }
+        size_t body_len = header.size + sizeof(header.size) - sizeof(header);
+        body.resize(body_len);
+        if (pread(m_fd, body.data(), body_len, location + sizeof(header)) != static_cast<ssize_t>(body_len)) {
+            return false;
+        }
+    }
+
+    message.id = header.id;
+    message.sent_at = TimePoint{std::chrono::nanoseconds(header.sent_at_ns)};
+    message.user_name = body.substr(0, header.user_len);
+    message.text = body.substr(header.user_len);
+    return true;
+}
+
+void MessageStore::Segment::search(const std::vector<std::string> &terms, const TimePoint &since,
+        size_t limit, std::vector<StoredMessage> &results) {
+    std::vector<uint32_t> found;
+    if (m_is_cold) {
+        found = SearchIndex::find_saved(m_saved_index, terms);
+    }
+    else {
+        // Only the posting lists of the terms are copied under the lock, the appends
+        // don't wait for their decoding and intersection
+        SearchIndex lists;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            lists = m_index.select(terms);
+        }
+        found = lists.find_all(terms);
+    }
+
+    // Only the newest matches can be needed, read them outside the lock
+    std::vector<uint64_t> offsets;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t needed = limit - results.size();
+        auto segment_offsets = get_offsets();
+        for (auto it = found.rbegin(); it != found.rend() && offsets.size() < needed; ++it) {
+            if (*it < segment_offsets.size()) {
+                offsets.push_back(segment_offsets[*it]);
+            }
+        }
+    }
+
+    for (auto offset: offsets) {
+        StoredMessage message;
+        if (!read(offset, message)) {
+            continue;
+        }
+        if (message.sent_at < since) {
+            break;
+        }
+        results.push_back(std::move(message));
+    }
+}
+
+bool MessageStore::Segment::read_after(uint64_t after_id, size_t limit,
+        std::vector<StoredMessage> &results) {
+    // Pairs of id and offset, only the newest are read (outside the lock)
+    std::vector<std::pair<uint64_t, uint64_t>> found;
+    bool older_needed = true;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto ids = get_ids();
+        auto offsets = get_offsets();
+        for (size_t i = 0; i < ids.size(); i++) {
+            if (ids[i] > after_id) {
+                found.emplace_back(ids[i], offsets[i]);
+            }
+            else {
+                older_needed = false;
+            }
+        }
+    }
+    if (found.size() > limit) {
+        std::nth_element(found.begin(), found.end() - limit, found.end());
+        found.erase(found.begin(), found.end() - limit);
+    }
+
+    for (auto [id, offset]: found) {
+        StoredMessage message;
+        if (read(offset, message)) {
+            results.push_back(std::move(message));
+        }
+    }
+    return older_needed;
+}
+
+// Writes a cold segment to a temporary file, renamed by commit()
+class ColdWriter {
+    std::string m_path;
+    std::string m_temp_path;
+    int m_fd = -1;
+    std::string m_block;
+    IoThrottle &m_throttle;
+
+    bool write_block(const BlockHeader &header, std::string_view data) {
+        if (!write_all(m_fd, &header, sizeof(header)) || !write_all(m_fd, data.data(), data.size())) {
+            std::cerr << m_temp_path << ": write error " << errno << std::endl;
+            return false;
+        }
+        m_size += sizeof(header) + data.size();
+        m_throttle.add(sizeof(header) + data.size());
+        return true;
+    }
+
+    bool flush_block() {
+        if (m_block.empty()) {
+            return true;
+        }
+        std::string data(compressBound(m_block.size()), '\0');
+        uLongf data_len = data.size();
+        if (compress2(reinterpret_cast<Bytef*>(data.data()), &data_len,
+                reinterpret_cast<const Bytef*>(m_block.data()), m_block.size(), COLD_COMPRESS_LEVEL) != Z_OK) {
+            return false;
+        }
+        BlockHeader header{static_cast<uint32_t>(data_len), static_cast<uint32_t>(m_block.size())};
+        m_block.clear();
+        return write_block(header, std::string_view(data.data(), data_len));
+    }
+
+public:
+    uint64_t m_size = 0;
+    size_t m_message_count = 0;
+
+    ColdWriter(IoThrottle &throttle) : m_throttle(throttle) {}
+    ~ColdWriter() {
+        if (m_fd >= 0) {
+            // Not committed
+            close(m_fd);
+            unlink(m_temp_path.c_str());
+        }
+    }
+
+    bool open(const std::string &path, int64_t last_start) {
+        m_path = path;
+        m_temp_path = path + TEMP_FILE_EXT;
+        m_fd = ::open(m_temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            std::cerr << "Can't create " << m_temp_path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        ColdHeader header{.last_start = last_start};
+        memcpy(header.magic, COLD_MAGIC, sizeof(header.magic));
+        m_size = sizeof(header);
+        return write_all(m_fd, &header, sizeof(header));
+    }
+
+    bool add_record(std::string_view record) {
+        m_block += record;
+        m_message_count++;
+        return m_block.size() < COLD_BLOCK_SIZE || flush_block();
+    }
+
+    // Block of another cold segment, without decompression
+    bool add_block(const BlockHeader &header, std::string_view data) {
+        return flush_block() && write_block(header, data);
+    }
+
+    bool commit() {
+        if (!flush_block() || fdatasync(m_fd) < 0) {
+            return false;
+        }
+        close(m_fd);
+        m_fd = -1;
+        // Atomic replace, when appended to the same cold segment
+        if (rename(m_temp_path.c_str(), m_path.c_str()) < 0) {
+            std::cerr << "Can't rename " << m_temp_path << ": " << strerror(errno) << std::endl;
+            unlink(m_temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+MessageStore::MessageStore() {
+}
+
+MessageStore::~MessageStore() {
+    stop_compaction();
+}
+
+MessageStore &MessageStore::instance() {
+    // Function static singleton for lazy initialization
+    static MessageStore store;
+    return store;
+}
+
+bool MessageStore::open(const std::string &directory, bool is_shared) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        std::cerr << "Can't create " << directory << ": " << error.message() << std::endl;
+        return false;
+    }
+
+    // Pairs of start and is cold, cold ones are older than all the hot ones
+    std::vector<std::pair<int64_t, bool>> starts;
+    for (const auto &entry: std::filesystem::directory_iterator(directory)) {
+        auto extension = entry.path().extension();
+        if (extension == TEMP_FILE_EXT) {
+            // Compaction interrupted, its inputs are still there
+            std::filesystem::remove(entry.path(), error);
+            continue;
+        }
+        if (extension == INDEX_FILE_EXT) {
+            // Its cold segment removed by the retention (crash before the index)
+            if (!std::filesystem::exists(std::filesystem::path(entry.path()).replace_extension(COLD_FILE_EXT), error)) {
+                std::filesystem::remove(entry.path(), error);
+            }
+            continue;
+        }
+        if (extension == SEGMENT_FILE_EXT || extension == COLD_FILE_EXT) {
+            try {
+                starts.emplace_back(std::stoll(entry.path().stem().string()), extension == COLD_FILE_EXT);
+            }
+            catch (const std::exception &) {
+                std::cerr << "Unexpected file " << entry.path() << std::endl;
+            }
+        }
+    }
+    // Cold one before the hot one of the same start (merged into it)
+    std::sort(starts.begin(), starts.end(), [](const auto &a, const auto &b) {
+        return a.first != b.first ? a.first < b.first : a.second > b.second;
+    });
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = directory;
+    m_segments.clear();
+    uint64_t max_id = 0;
+    int64_t cold_last_start = INT64_MIN;
+    for (auto [start, is_cold]: starts) {
+        auto path = is_cold ?
+                std::format(COLD_FILENAME_FMT, directory, start) :
+                std::format(SEGMENT_FILENAME_FMT, directory, start);
+        if (!is_cold && start <= cold_last_start) {
+            // Merged, but not deleted (crash during compaction)
+            std::filesystem::remove(path, error);
+            continue;
+        }
+        auto segment = std::make_shared<Segment>(path, start, is_cold);
+        if (!segment->load(max_id, is_shared)) {
+            return false;
+        }
+        if (is_cold) {
+            cold_last_start = std::max(cold_last_start, segment->m_last_start);
+        }
+        m_segments.push_back(segment);
+    }
+    m_last_id = max_id;
+    return true;
+}
+
+bool MessageStore::catch_up() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t max_id = m_last_id;
+    int64_t last_start = INT64_MIN;
+    for (auto &segment: m_segments) {
+        if (!segment->catch_up(max_id)) {
+            return false;
+        }
+        last_start = std::max(last_start, segment->m_is_cold ? segment->m_last_start : segment->m_start);
+    }
+
+    // Started meanwhile, the compaction was stopped (no new cold ones)
+    std::vector<int64_t> starts;
+    for (const auto &entry: std::filesystem::directory_iterator(m_directory)) {
+        if (entry.path().extension() != SEGMENT_FILE_EXT) {
+            continue;
+        }
+        try {
+            auto start = std::stoll(entry.path().stem().string());
+            if (start > last_start) {
+                starts.push_back(start);
+            }
+        }
+        catch (const std::exception &) {
+        }
+    }
+    std::sort(starts.begin(), starts.end());
+    for (auto start: starts) {
+        auto segment = std::make_shared<Segment>(std::format(SEGMENT_FILENAME_FMT, m_directory, start), start);
+        if (!segment->load(max_id)) {
+            return false;
+        }
+        m_segments.push_back(segment);
+    }
+    m_last_id = max_id;
+    return true;
+}
+
+std::shared_ptr<MessageStore::Segment> MessageStore::select_segment(const TimePoint &sent_at) {
+    auto start = Config::round_time(std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+            sent_at)).time_since_epoch().count();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_directory.empty()) {
+        return nullptr;     // Not opened
+    }
+    // Late messages from the previous period go to the current segment
+    if (m_segments.empty() || m_segments.back()->m_start < start || m_segments.back()->m_is_cold) {
+        auto segment = std::make_shared<Segment>(std::format(SEGMENT_FILENAME_FMT, m_directory, start), start);
+        uint64_t max_id = 0;
+        if (!segment->load(max_id)) {
+            return nullptr;
+        }
+        m_segments.push_back(segment);
+    }
+    return m_segments.back();
+}
+
+bool MessageStore::append(uint64_t id, const TimePoint &sent_at, const std::string &user_name,
+        const std::string &text) {
+    auto segment = select_segment(sent_at);
+    if (segment == nullptr) {
+        return false;
+    }
+
+    uint64_t last_id = m_last_id;
+    while (last_id < id && !m_last_id.compare_exchange_weak(last_id, id)) {
+    }
+    if (!segment->append(id, sent_at, user_name, text)) {
+        // Sealed by the compaction meanwhile, retry in the newest one
+        auto newest = select_segment(sent_at);
+        return newest && newest != segment && newest->append(id, sent_at, user_name, text);
+    }
+    return true;
+}
+
+std::vector<StoredMessage> MessageStore::read_after(uint64_t after_id, size_t limit) {
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        segments = m_segments;
+    }
+
+    std::vector<StoredMessage> results;
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        if (!(*it)->read_after(after_id, limit - results.size(), results) || results.size() >= limit) {
+            break;
+        }
+    }
+
+    // Store tasks run in parallel, the ids in a segment can be slightly out of order
+    std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+        return a.id < b.id;
+    });
+    if (results.size() > limit) {
+        results.erase(results.begin(), results.end() - limit);
+    }
+    return results;
+}
+
+std::vector<StoredMessage> MessageStore::search(const std::string &text, const std::string &user_name,
+        const TimePoint &since, size_t limit) {
+    auto terms = SearchIndex::tokenize(text);
+    if (user_name.size()) {
+        terms.push_back(SearchIndex::user_term(user_name));
+    }
+
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        segments = m_segments;
+    }
+
+    // Newest segments first, results are ranked by recency
+    std::vector<StoredMessage> results;
+    for (auto it = segments.rbegin(); it != segments.rend() && results.size() < limit; ++it) {
+        if ((*it)->get_last_sent_at() < since) {
+            break;
+        }
+        (*it)->search(terms, since, limit, results);
+    }
+    return results;
+}
+
+size_t MessageStore::get_message_count() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t count = 0;
+    for (auto &segment: m_segments) {
+        count += segment->get_message_count();
+    }
+    return count;
+}
+
+size_t MessageStore::get_segment_count() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_segments.size();
+}
+
+void MessageStore::start_compaction() {
+    m_is_stopping = false;
+    m_compactor = std::thread([this] { compact_loop(); });
+}
+
+void MessageStore::stop_compaction() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_is_stopping = true;
+    }
+    m_compact_cond.notify_all();
+    if (m_compactor.joinable()) {
+        m_compactor.join();
+    }
+}
+
+void MessageStore::compact_now() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_compact_now = true;
+    }
+    m_compact_cond.notify_all();
+}
+
+void MessageStore::compact_loop() {
+    // Idle I/O class and lower CPU priority: the live reads and writes go first
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    setpriority(PRIO_PROCESS, gettid(), 10);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_is_stopping) {
+        // Zero interval is off, but still checked for reload
+        auto interval = Config::get(Config::store_compact_interval);
+        m_compact_cond.wait_for(lock, std::chrono::seconds(interval ? interval : 60),
+                [this] { return m_is_stopping || m_compact_now; });
+        if (m_is_stopping || (!m_compact_now && interval == 0)) {
+            continue;
+        }
+        m_compact_now = false;
+
+        lock.unlock();
+        auto started_at = std::chrono::steady_clock::now();
+        bool did_work = false;
+        while (!m_is_stopping && compact_step()) {
+            did_work = true;
+        }
+        lock.lock();
+        if (did_work) {
+            m_stats.runs++;
+            m_stats.last_duration = std::chrono::steady_clock::now() - started_at;
+        }
+    }
+}
+
+bool MessageStore::compact_step() {
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        segments = m_segments;
+    }
+    // The newest one takes the appends, never compacted
+    if (segments.size() < 2) {
+        return false;
+    }
+
+    auto max_age = Config::get(Config::store_max_age);
+    auto max_size = static_cast<uint64_t>(Config::get(Config::store_max_size));
+    auto user_max = static_cast<uint32_t>(Config::get(Config::store_user_max));
+    TimePoint expire_before{};
+    if (max_age) {
+        expire_before = std::chrono::time_point_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now() - std::chrono::seconds(max_age));
+    }
+
+    // Retention by age and size: drop the oldest whole segments
+    uint64_t total_size = 0;
+    for (auto &segment: segments) {
+        total_size += segment->get_size();
+    }
+    size_t drop_count = 0;
+    for (; drop_count + 1 < segments.size(); drop_count++) {
+        bool is_expired = max_age && segments[drop_count]->get_last_sent_at() < expire_before;
+        bool is_over = max_size && total_size > max_size;
+        if (!is_expired && !is_over) {
+            break;
+        }
+        total_size -= segments[drop_count]->get_size();
+    }
+    if (drop_count) {
+        std::vector<std::shared_ptr<Segment>> dropped(segments.begin(), segments.begin() + drop_count);
+        for (auto &segment: dropped) {
+            segment->seal();
+        }
+        replace_segments(dropped, nullptr);
+        return true;
+    }
+
+    // Per-user retention: count the newer messages of each user, from the newest segment
+    std::vector<std::unordered_map<std::string, uint32_t>> newer_counts(segments.size());
+    std::vector<size_t> dead_counts(segments.size());
+    if (user_max) {
+        std::unordered_map<std::string, uint32_t> counts;
+        for (size_t i = segments.size(); i-- > 0; ) {
+            newer_counts[i] = counts;
+            for (const auto &[user_name, count]: segments[i]->get_user_counts()) {
+                uint32_t newer = counts[user_name];
+                dead_counts[i] += newer >= user_max ? count :
+                        newer + count > user_max ? newer + count - user_max : 0;
+                counts[user_name] += count;
+            }
+        }
+    }
+    // Hot segments, but the newest store-hot-segments, go to the last cold one, up to store-cold-size
+    size_t hot_begin = 0;
+    while (hot_begin < segments.size() && segments[hot_begin]->m_is_cold) {
+        hot_begin++;
+    }
+    size_t hot_keep = std::max<size_t>(Config::get(Config::store_hot_segments), 1);
+    size_t hot_end = segments.size() > hot_keep ? segments.size() - hot_keep : 0;
+    auto cold_size = static_cast<uint64_t>(Config::get(Config::store_cold_size));
+    if (hot_begin < hot_end) {
+        size_t first = hot_begin;
+        uint64_t raw_size = 0;
+        if (hot_begin > 0 && segments[hot_begin - 1]->get_raw_size() < cold_size) {
+            first = hot_begin - 1;
+            raw_size = segments[first]->get_raw_size();
+        }
+        size_t last = hot_begin;
+        raw_size += segments[last]->get_raw_size();
+        while (last + 1 < hot_end && raw_size + segments[last + 1]->get_raw_size() <= cold_size) {
+            raw_size += segments[++last]->get_raw_size();
+        }
+        std::vector<std::shared_ptr<Segment>> inputs(segments.begin() + first, segments.begin() + last + 1);
+        return rewrite(inputs, newer_counts[last], expire_before, user_max);
+    }
+
+    // Cold segments with many messages out of the per-user retention
+    for (size_t i = 0; i < hot_begin; i++) {
+        if (dead_counts[i] && dead_counts[i] * COLD_DEAD_RATIO >= segments[i]->get_message_count()) {
+            return rewrite({segments[i]}, newer_counts[i], expire_before, user_max);
+        }
+    }
+    return false;
+}
+
+bool MessageStore::rewrite(const std::vector<std::shared_ptr<Segment>> &inputs,
+        const std::unordered_map<std::string, uint32_t> &newer_counts,
+        const TimePoint &expire_before, uint32_t user_max) {
+    // User messages still to come (in the inputs), the older ones are kept
+    // only while the user has less than user_max newer
+    std::unordered_map<std::string, uint32_t> remaining;
+    int64_t last_start = 0;
+    for (auto &input: inputs) {
+        input->seal();
+        if (user_max) {
+            for (const auto &[user_name, count]: input->get_user_counts()) {
+                remaining[user_name] += count;
+            }
+        }
+        last_start = std::max(last_start, input->m_is_cold ? input->m_last_start : input->m_start);
+    }
+
+    IoThrottle throttle(Config::get(Config::store_compact_rate));
+    ColdWriter writer(throttle);
+    auto path = std::format(COLD_FILENAME_FMT, m_directory, inputs.front()->m_start);
+    if (!writer.open(path, last_start)) {
+        return false;
+    }
+
+    size_t dropped = 0;
+    for (auto &input: inputs) {
+        // Zero expire_before (no max age) is older than any
+        bool is_expired_part = input->get_first_sent_at() < expire_before;
+        auto input_counts = user_max ? input->get_user_counts() : std::unordered_map<std::string, uint32_t>{};
+        bool has_dead = false;
+        for (const auto &[user_name, count]: input_counts) {
+            // Newer messages than the user's oldest one in this input
+            auto it = newer_counts.find(user_name);
+            has_dead |= (it != newer_counts.end() ? it->second : 0) + remaining[user_name] - 1 >= user_max;
+        }
+
+        bool is_complete;
+        if (input->m_is_cold && !is_expired_part && !has_dead) {
+            // Nothing to drop: copy the compressed blocks
+            for (const auto &[user_name, count]: input_counts) {
+                remaining[user_name] -= count;
+            }
+            is_complete = input->scan_blocks([&](const BlockHeader &header, std::string_view data) {
+                throttle.add(sizeof(header) + data.size());
+                return !m_is_stopping && writer.add_block(header, data);
+            });
+            writer.m_message_count += input->get_message_count();
+        }
+        else {
+            is_complete = input->scan([&](const RecordHeader &header, std::string_view record) {
+                throttle.add(record.size());
+                TimePoint sent_at{std::chrono::nanoseconds(header.sent_at_ns)};
+                bool is_kept = !(is_expired_part && sent_at < expire_before);
+                if (user_max) {
+                    std::string user_name(record.substr(sizeof(header), header.user_len));
+                    auto it = newer_counts.find(user_name);
+                    uint32_t newer = (it != newer_counts.end() ? it->second : 0) + --remaining[user_name];
+                    is_kept = is_kept && newer < user_max;
+                }
+                if (!is_kept) {
+                    dropped++;
+                    return !m_is_stopping;
+                }
+                return !m_is_stopping && writer.add_record(record);
+            });
+        }
+        if (!is_complete) {
+            // Stopping or read error, the inputs are kept
+            return false;
+        }
+    }
+
+    std::shared_ptr<Segment> output;
+    if (writer.m_message_count) {
+        if (!writer.commit()) {
+            return false;
+        }
+        output = std::make_shared<Segment>(path, inputs.front()->m_start, true);
+        uint64_t max_id = 0;
+        // Indexed once here, the index file is loaded on open (also validates the written file)
+        if (!output->load(max_id)) {
+            return false;
+        }
+    }
+    replace_segments(inputs, output);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (output) {
+        m_stats.merged_segments += inputs.size();
+        m_stats.written_bytes += writer.m_size;
+    }
+    m_stats.dropped_messages += dropped;
+    return true;
+}
+
+void MessageStore::replace_segments(const std::vector<std::shared_ptr<Segment>> &inputs,
+        std::shared_ptr<Segment> output) {
+    {
+        // Inputs are consecutive, only the compaction removes segments
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_segments.begin(), m_segments.end(), inputs.front());
+        if (it == m_segments.end()) {
+            return;
+        }
+        it = m_segments.erase(it, it + inputs.size());
+        if (output) {
+            m_segments.insert(it, output);
+        }
+        else {
+            m_stats.removed_segments += inputs.size();
+        }
+    }
+
+    // Readers may still have them open, the files are gone when they are done
+    for (auto &input: inputs) {
+        if (output == nullptr || input->m_path != output->m_path) {
+            std::error_code error;
+            std::filesystem::remove(input->m_path, error);
+            if (input->m_is_cold) {
+                std::filesystem::remove(input->get_index_path(), error);
+            }
+        }
+    }
+}
+
+std::vector<std::string> MessageStore::get_report() {
+    std::vector<std::shared_ptr<Segment>> segments;
+    CompactionStats stats;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        segments = m_segments;
+        stats = m_stats;
+    }
+
+    // Index 0 for hot, 1 for cold
+    size_t counts[2] = {}, messages[2] = {};
+    uint64_t sizes[2] = {}, raw_sizes[2] = {};
+    TimePoint oldest = TimePoint::max();
+    for (auto &segment: segments) {
+        int tier = segment->m_is_cold;
+        counts[tier]++;
+        messages[tier] += segment->get_message_count();
+        sizes[tier] += segment->get_size();
+        raw_sizes[tier] += segment->get_raw_size();
+        oldest = std::min(oldest, segment->get_first_sent_at());
+    }
+
+    std::vector<std::string> report;
+    report.push_back(std::format("Hot: {} segments, {} messages, {} bytes", counts[0], messages[0], sizes[0]));
+    report.push_back(std::format("Cold: {} segments, {} messages, {} bytes ({} uncompressed, ratio {:.1f})",
+            counts[1], messages[1], sizes[1], raw_sizes[1],
+            sizes[1] ? static_cast<double>(raw_sizes[1]) / sizes[1] : 0.0));
+    if (oldest != TimePoint::max()) {
+        report.push_back(std::format("Oldest message: {:%Y-%m-%d %H:%M:%S}",
+                std::chrono::floor<std::chrono::seconds>(oldest)));
+    }
+    report.push_back(std::format("Compaction: {} runs, {} segments merged, {} removed, {} messages dropped, "
+            "{} bytes written, last run {} ms", stats.runs, stats.merged_segments, stats.removed_segments,
+            stats.dropped_messages, stats.written_bytes,
+            std::chrono::duration_cast<std::chrono::milliseconds>(stats.last_duration).count()));
+    return report;
+}
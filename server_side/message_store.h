@@ -0,0 +1,95 @@
+/*
+ * MessageStore class declaration
+ */
+
+struct StoredMessage {
+    uint64_t id;
+    std::chrono::sys_time<std::chrono::nanoseconds> sent_at;
+    std::string user_name;
+    std::string text;
+};
+
+// Persistent chat message storage: append-only segment files, one per
+// log-time-round period, each with its own search index.
+// Older (hot) segments are merged by the background compaction into large
+// compressed (cold) segments, the retention policies drop the oldest messages.
+class MessageStore {
+public:
+    using TimePoint = std::chrono::sys_time<std::chrono::nanoseconds>;
+
+private:
+    class Segment;
+
+    std::string m_directory;
+    // Oldest first (cold ones, then hot), the last one takes the new messages
+    std::vector<std::shared_ptr<Segment>> m_segments;
+    std::mutex m_mutex;
+    std::atomic<uint64_t> m_last_id = 0;
+
+    // Compaction thread, locks m_mutex only to take and replace the segments
+    struct CompactionStats {
+        uint64_t runs = 0;
+        uint64_t merged_segments = 0;
+        uint64_t removed_segments = 0;
+        uint64_t dropped_messages = 0;
+        uint64_t written_bytes = 0;
+        std::chrono::steady_clock::duration last_duration{};
+    };
+    std::thread m_compactor;
+    std::condition_variable m_compact_cond;
+    std::atomic<bool> m_is_stopping = false;
+    // Guarded by m_mutex
+    bool m_compact_now = false;
+    CompactionStats m_stats;
+
+    MessageStore();
+
+    std::shared_ptr<Segment> select_segment(const TimePoint &sent_at);
+
+    void compact_loop();
+    // One retention or compaction step, returns false when there is nothing to do
+    bool compact_step();
+    // Merge the consecutive segments into a cold one, filtered by the retention
+    bool rewrite(const std::vector<std::shared_ptr<Segment>> &inputs,
+            const std::unordered_map<std::string, uint32_t> &newer_counts,
+            const TimePoint &expire_before, uint32_t user_max);
+    // Put output (or nothing) in place of the inputs, delete their files
+    void replace_segments(const std::vector<std::shared_ptr<Segment>> &inputs,
+            std::shared_ptr<Segment> output);
+
+public:
+    ~MessageStore();
+
+    static MessageStore &instance();
+
+    // Load existing segments, rebuilds their search indexes
+    // (shared: the previous process still appends, with its compaction stopped)
+    bool open(const std::string &directory, bool is_shared = false);
+    // Shared: load what the previous process appended since open, after it stopped
+    bool catch_up();
+
+    // The id is the broadcast sequence number
+    bool append(uint64_t id, const TimePoint &sent_at, const std::string &user_name,
+            const std::string &text);
+    uint64_t get_last_id() const { return m_last_id; }
+
+    // Messages with id greater than after_id (the newest limit ones), ascending
+    std::vector<StoredMessage> read_after(uint64_t after_id, size_t limit);
+
+    // Newest messages, containing all the words from text
+    // (optionally only from user_name and not older than since)
+    std::vector<StoredMessage> search(const std::string &text, const std::string &user_name,
+            const TimePoint &since, size_t limit);
+
+    size_t get_message_count();
+    size_t get_segment_count();
+
+    // Start the background retention and compaction (after open)
+    void start_compaction();
+    // Stop it, an unfinished compaction leaves only a temporary file
+    void stop_compaction();
+    // Run it now, instead of waiting for store-compact-interval
+    void compact_now();
+    // Tiers, disk usage and compaction counters
+    std::vector<std::string> get_report();
+};
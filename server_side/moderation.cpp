@@ -0,0 +1,493 @@
+/*
+ * ModerationFilter class implementation
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <atomic>
+#include <memory>
+#include <array>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <cctype>
+#include <cstring>
+#include <bit>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "moderation.h"
+
+
+// Prefilter: set of the pattern prefix hashes, bits (8 KB, in L1 cache)
+#define PREFIX_HASH_BITS        16
+// Used while at most 1/N of the set is filled, otherwise the automaton scans all
+#define PREFIX_MAX_FILL         8
+
+/*
+ * Rules file lines: "<action> <pattern>", '#' starts a comment.
+ * Patterns are case-insensitive (ASCII), matched as whole words, unless
+ * started or ended by '*' (like "darn*" matches "darned" too).
+ */
+class ModerationFilter::Automaton {
+public:
+    struct Rule {
+        std::string pattern;
+        Action action;
+        bool is_open_start;
+        bool is_open_end;
+    };
+    std::vector<Rule> m_rules;
+    std::string m_path;
+
+private:
+    // Byte to its class (case folded), 0 for the bytes not in any pattern
+    std::array<uint8_t, 256> m_classes{};
+    uint32_t m_class_count = 1;
+    // Transitions, state * m_class_count + class to the next state (also multiplied),
+    // the states with matched rules are numbered last (one compare per byte)
+    std::vector<uint32_t> m_next;
+    uint32_t m_first_output = 0;
+    // Rules ending in each output state (own and of its suffixes)
+    std::vector<uint32_t> m_output_begin;
+    std::vector<uint32_t> m_outputs;
+    size_t m_max_length = 0;
+    // Length of the pattern prefix of each state
+    std::vector<uint32_t> m_depths;
+
+    // Prefilter: the first bytes of each pattern (up to 4, the shortest pattern),
+    // hashed; the automaton runs only from the text positions found in the set.
+    // Zero length when not used (too many short patterns).
+    size_t m_prefix_length = 0;
+    uint32_t m_prefix_mask = 0;
+    std::vector<uint64_t> m_prefix_set;
+    // No pattern matches inside a word (starting with '*'): only the word starts are
+    // candidates, and only the word bytes when all the patterns start with one
+    bool m_is_word_start_only = true;
+    bool m_is_word_first = true;
+
+    // Case folded (approximately, the automaton checks), little-endian word of
+    // the bytes at s, zero padded after available
+    uint32_t prefix_hash(const char *s, size_t available) const {
+        uint32_t word = 0;
+        if (available >= sizeof(word)) {
+            memcpy(&word, s, sizeof(word));
+        }
+        else {
+            for (size_t i = 0; i < available; i++) {
+                word |= static_cast<uint32_t>(static_cast<uint8_t>(s[i])) << (i * 8);
+            }
+        }
+        word = (word | 0x20202020) & m_prefix_mask;
+        return word * 0x9E3779B1 >> (32 - PREFIX_HASH_BITS);
+    }
+    bool is_prefix(uint32_t hash) const {
+        return m_prefix_set[hash / 64] >> (hash % 64) & 1;
+    }
+#if defined(__SSE2__)
+    // Bit i set for the non-word byte s[i], of 16 bytes
+    static uint64_t find_separators16(const char *s) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+        __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+        __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        // Signed: the bytes >= 0x80 are negative
+        __m128i high = _mm_cmplt_epi8(bytes, _mm_setzero_si128());
+        __m128i words = _mm_or_si128(_mm_or_si128(letters, digits), high);
+        return ~_mm_movemask_epi8(words) & 0xFFFF;
+    }
+#endif
+
+    static bool is_word_byte(uint8_t c) {
+        // ASCII letters and digits, UTF-8 multi-byte characters are letters
+        return static_cast<uint8_t>((c | 0x20) - 'a') < 26 || static_cast<uint8_t>(c - '0') < 10 || c >= 0x80;
+    }
+
+    // Rules ending at text[i], in the output state
+    // (only those beginning at only_begin, unless npos)
+    template <typename Found>
+    void report(std::string_view text, size_t i, uint32_t state, Found &found,
+            size_t only_begin = std::string_view::npos) const {
+        uint32_t index = (state - m_first_output) / m_class_count;
+        for (uint32_t j = m_output_begin[index]; j < m_output_begin[index + 1]; j++) {
+            const auto &rule = m_rules[m_outputs[j]];
+            size_t begin = i + 1 - rule.pattern.size();
+            if (only_begin != std::string_view::npos && begin != only_begin) {
+                continue;
+            }
+            if ((rule.is_open_start || begin == 0 || !is_word_byte(text[begin - 1])) &&
+                    (rule.is_open_end || i + 1 == text.size() || !is_word_byte(text[i + 1]))) {
+                found(rule, begin, i + 1);
+            }
+        }
+    }
+
+    // Rules matched from text[begin], until no pattern can continue from there
+    // (the state is a shorter prefix than the text from begin)
+    template <typename Found>
+    void match_at(std::string_view text, size_t begin, Found &found) const {
+        uint32_t state = 0;
+        size_t end = std::min(text.size(), begin + m_max_length);
+        for (size_t i = begin; i < end; i++) {
+            state = m_next[state + m_classes[static_cast<uint8_t>(text[i])]];
+            if (m_depths[state / m_class_count] <= i - begin) {
+                return;
+            }
+            if (state >= m_first_output) {
+                report(text, i, state, found, begin);
+            }
+        }
+    }
+
+public:
+    void build();
+
+    // Calls found(rule, begin, end) for each matched rule
+    template <typename Found>
+    void match(std::string_view text, Found found) const {
+        if (m_prefix_length) {
+            // The automaton runs only from the candidates: the prefix hash is in the
+            // set (independent checks, not latency bound like the transitions)
+            size_t end = text.size() + 1 - std::min(text.size() + 1, m_prefix_length);
+            auto check = [&](size_t p) {
+                if (is_prefix(prefix_hash(text.data() + p, text.size() - p))) {
+                    match_at(text, p, found);
+                }
+            };
+            size_t p = 0;
+            if (!m_is_word_start_only) {
+                for (; p < end; p++) {
+                    check(p);
+                }
+                return;
+            }
+
+            // Whole word patterns: only the word starts (after a non-word byte),
+            // found in 64 bytes at once (the last ones copied, zero padded)
+#if defined(__SSE2__)
+            uint64_t after_separator = 1;
+            for (; p < end; p += 64) {
+                const char *block = text.data() + p;
+                char last[64];
+                if (p + 64 > text.size()) {
+                    memset(last, 0, sizeof(last));
+                    memcpy(last, block, text.size() - p);
+                    block = last;
+                }
+                uint64_t separators = find_separators16(block) | find_separators16(block + 16) << 16 |
+                        find_separators16(block + 32) << 32 | find_separators16(block + 48) << 48;
+                uint64_t starts = separators << 1 | after_separator;
+                after_separator = separators >> 63;
+                if (m_is_word_first) {
+                    starts &= ~separators;
+                }
+                if (end - p < 64) {
+                    starts &= (uint64_t(1) << (end - p)) - 1;
+                }
+                for (; starts; starts &= starts - 1) {
+                    check(p + std::countr_zero(starts));
+                }
+            }
+#endif
+            for (; p < end; p++) {
+                if ((p == 0 || !is_word_byte(text[p - 1])) && (!m_is_word_first || is_word_byte(text[p]))) {
+                    check(p);
+                }
+            }
+            return;
+        }
+
+        // Each transition waits for the previous one (memory latency bound): the text
+        // parts are scanned interleaved, each lane starts before its part by the
+        // longest pattern to reach the right state
+        constexpr size_t LANES = 4;
+        size_t part = text.size() / LANES;
+        size_t warm_up = m_max_length - 1;
+        if (part < warm_up * 2) {
+            uint32_t state = 0;
+            for (size_t i = 0; i < text.size(); i++) {
+                state = m_next[state + m_classes[static_cast<uint8_t>(text[i])]];
+                if (state >= m_first_output) {
+                    report(text, i, state, found);
+                }
+            }
+            return;
+        }
+
+        std::array<uint32_t, LANES> states{};
+        std::array<size_t, LANES> begins, report_from, ends;
+        for (size_t l = 0; l < LANES; l++) {
+            report_from[l] = l * part;
+            begins[l] = l ? report_from[l] - warm_up : 0;
+            ends[l] = l + 1 < LANES ? report_from[l] + part : text.size();
+        }
+        auto step = [&](size_t l, size_t i) {
+            states[l] = m_next[states[l] + m_classes[static_cast<uint8_t>(text[i])]];
+            if (states[l] >= m_first_output && i >= report_from[l]) {
+                report(text, i, states[l], found);
+            }
+        };
+        // Lane 0 is the shortest
+        for (size_t n = 0; n < part; n++) {
+            for (size_t l = 0; l < LANES; l++) {
+                step(l, begins[l] + n);
+            }
+        }
+        for (size_t l = 1; l < LANES; l++) {
+            for (size_t i = begins[l] + part; i < ends[l]; i++) {
+                step(l, i);
+            }
+        }
+    }
+};
+
+void ModerationFilter::Automaton::build() {
+    // Byte classes of the pattern characters, both cases of a letter are the same class
+    for (const auto &rule: m_rules) {
+        m_max_length = std::max(m_max_length, rule.pattern.size());
+        for (uint8_t c: rule.pattern) {
+            if (m_classes[c] == 0) {
+                m_classes[c] = m_class_count;
+                m_classes[std::toupper(c)] = m_class_count;
+                m_class_count++;
+            }
+        }
+    }
+
+    // Trie, -1 for no child
+    std::vector<std::vector<int32_t>> children(1, std::vector<int32_t>(m_class_count, -1));
+    std::vector<std::vector<uint32_t>> outputs(1);
+    std::vector<uint32_t> depths(1, 0);
+    for (uint32_t r = 0; r < m_rules.size(); r++) {
+        uint32_t state = 0;
+        for (uint8_t c: m_rules[r].pattern) {
+            auto &child = children[state][m_classes[c]];
+            if (child < 0) {
+                child = children.size();
+                children.emplace_back(m_class_count, -1);
+                outputs.emplace_back();
+                depths.push_back(depths[state] + 1);
+            }
+            state = child;
+        }
+        outputs[state].push_back(r);
+    }
+
+    // Breadth-first: the failure state (longest suffix in the trie) is done before,
+    // its transitions replace the missing children
+    size_t state_count = children.size();
+    std::vector<uint32_t> fail(state_count, 0);
+    std::deque<uint32_t> queue;
+    for (auto &child: children[0]) {
+        if (child < 0) {
+            child = 0;
+        }
+        else {
+            queue.push_back(child);
+        }
+    }
+    while (queue.size()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        const auto &suffix_outputs = outputs[fail[state]];
+        outputs[state].insert(outputs[state].end(), suffix_outputs.begin(), suffix_outputs.end());
+        for (uint32_t c = 0; c < m_class_count; c++) {
+            auto &child = children[state][c];
+            if (child < 0) {
+                child = children[fail[state]][c];
+            }
+            else {
+                fail[child] = children[fail[state]][c];
+                queue.push_back(child);
+            }
+        }
+    }
+
+    // Number the output states last, multiplied by the class count
+    std::vector<uint32_t> numbers(state_count);
+    std::vector<uint32_t> sorted(state_count);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::stable_partition(sorted.begin(), sorted.end(), [&](uint32_t state) {
+        return outputs[state].empty();
+    });
+    for (uint32_t i = 0; i < state_count; i++) {
+        numbers[sorted[i]] = i * m_class_count;
+    }
+    m_first_output = state_count * m_class_count;
+    m_next.resize(state_count * m_class_count);
+    m_depths.resize(state_count);
+    m_output_begin.push_back(0);
+    for (uint32_t i = 0; i < state_count; i++) {
+        uint32_t state = sorted[i];
+        m_depths[i] = depths[state];
+        for (uint32_t c = 0; c < m_class_count; c++) {
+            m_next[i * m_class_count + c] = numbers[children[state][c]];
+        }
+        if (outputs[state].size()) {
+            m_first_output = std::min(m_first_output, i * m_class_count);
+            m_outputs.insert(m_outputs.end(), outputs[state].begin(), outputs[state].end());
+            m_output_begin.push_back(m_outputs.size());
+        }
+    }
+
+    // Prefilter, unless it would pass most of the text
+    size_t min_length = sizeof(uint32_t);
+    for (const auto &rule: m_rules) {
+        min_length = std::min(min_length, rule.pattern.size());
+        m_is_word_start_only = m_is_word_start_only && !rule.is_open_start;
+        m_is_word_first = m_is_word_first && is_word_byte(rule.pattern[0]);
+    }
+    m_prefix_length = min_length;
+    m_prefix_mask = min_length < sizeof(uint32_t) ? (1u << (min_length * 8)) - 1 : ~0u;
+    m_prefix_set.assign((1 << PREFIX_HASH_BITS) / 64, 0);
+    size_t filled = 0;
+    for (const auto &rule: m_rules) {
+        uint32_t hash = prefix_hash(rule.pattern.data(), rule.pattern.size());
+        if (!is_prefix(hash)) {
+            m_prefix_set[hash / 64] |= uint64_t(1) << (hash % 64);
+            filled++;
+        }
+    }
+    if (filled * PREFIX_MAX_FILL > (1 << PREFIX_HASH_BITS)) {
+        m_prefix_length = 0;
+    }
+}
+
+// Thread's reference to the automaton, not to lock the atomic shared_ptr per message
+struct ModerationFilter::AutomatonCache {
+    uint64_t generation = 0;
+    std::shared_ptr<const Automaton> automaton;
+};
+
+thread_local ModerationFilter::AutomatonCache ModerationFilter::t_cache;
+
+ModerationFilter::ModerationFilter() {
+}
+
+ModerationFilter::~ModerationFilter() {
+}
+
+ModerationFilter &ModerationFilter::instance() {
+    // Function static singleton for lazy initialization
+    static ModerationFilter filter;
+    return filter;
+}
+
+bool ModerationFilter::load(const std::string &path, std::vector<std::string> &report) {
+    if (path.empty()) {
+        m_automaton.store(nullptr);
+        m_generation++;
+        return true;
+    }
+
+    std::ifstream file(path);
+    if (!file) {
+        report.push_back(std::format("Can't read moderation rules {}", path));
+        return false;
+    }
+
+    auto automaton = std::make_shared<Automaton>();
+    size_t errors = report.size();
+    size_t counts[REJECT + 1] = {};
+    std::string line;
+    for (int line_num = 1; std::getline(file, line); line_num++) {
+        line = line.substr(0, line.find('#'));
+        auto begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos) {
+            continue;
+        }
+        auto end = line.find_first_of(" \t", begin);
+        auto action_name = line.substr(begin, end == std::string::npos ? end : end - begin);
+        auto pattern_begin = end == std::string::npos ? end : line.find_first_not_of(" \t", end);
+        std::string pattern = pattern_begin == std::string::npos ? "" :
+                line.substr(pattern_begin, line.find_last_not_of(" \t\r") + 1 - pattern_begin);
+
+        Automaton::Rule rule{};
+        rule.action = action_name == "reject" ? REJECT : action_name == "redact" ? REDACT :
+                action_name == "flag" ? FLAG : PASS;
+        rule.is_open_start = pattern.starts_with('*');
+        rule.is_open_end = pattern.size() > 1 && pattern.ends_with('*');
+        rule.pattern = pattern.substr(rule.is_open_start, pattern.size() - rule.is_open_start - rule.is_open_end);
+        std::transform(rule.pattern.begin(), rule.pattern.end(), rule.pattern.begin(), [](unsigned char c) {
+            return std::tolower(c);
+        });
+        if (rule.action == PASS || rule.pattern.empty()) {
+            report.push_back(std::format("{}:{}: expected '<reject|redact|flag> <pattern>'", path, line_num));
+            continue;
+        }
+        counts[rule.action]++;
+        automaton->m_rules.push_back(std::move(rule));
+    }
+    if (report.size() > errors) {
+        report.push_back("Moderation rules not reloaded");
+        return false;
+    }
+
+    automaton->m_path = path;
+    automaton->build();
+    m_automaton.store(automaton);
+    m_generation++;
+    report.push_back(std::format("Moderation: {} rules ({} reject, {} redact, {} flag) from {}",
+            automaton->m_rules.size(), counts[REJECT], counts[REDACT], counts[FLAG], path));
+    return true;
+}
+
+ModerationFilter::Action ModerationFilter::check(std::string &text, std::string &rule) {
+    uint64_t generation = m_generation.load(std::memory_order_acquire);
+    if (t_cache.generation != generation) {
+        t_cache.automaton = m_automaton.load();
+        t_cache.generation = generation;
+    }
+    auto automaton = t_cache.automaton.get();
+    if (automaton == nullptr) {
+        return PASS;
+    }
+    m_checked.fetch_add(1, std::memory_order_relaxed);
+
+    Action result = PASS;
+    std::vector<std::pair<size_t, size_t>> redacted;
+    automaton->match(text, [&](const Automaton::Rule &matched, size_t begin, size_t end) {
+        if (matched.action > result) {
+            result = matched.action;
+            rule = matched.pattern;
+        }
+        if (matched.action == REDACT) {
+            redacted.emplace_back(begin, end);
+        }
+    });
+
+    switch (result) {
+    case PASS:
+        break;
+    case FLAG:
+        m_flagged.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case REDACT:
+        // After the match, overlapping patterns are all found
+        for (auto [begin, end]: redacted) {
+            std::fill(text.begin() + begin, text.begin() + end, '*');
+        }
+        m_redacted.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case REJECT:
+        m_rejected.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    return result;
+}
+
+std::vector<std::string> ModerationFilter::get_report() {
+    auto automaton = m_automaton.load();
+    std::vector<std::string> report;
+    report.push_back(automaton ?
+            std::format("{} rules from {}", automaton->m_rules.size(), automaton->m_path) :
+            "No moderation rules (see moderation-file)");
+    report.push_back(std::format("{} messages checked: {} rejected, {} redacted, {} flagged",
+            m_checked.load(), m_rejected.load(), m_redacted.load(), m_flagged.load()));
+    return report;
+}
@@ -0,0 +1,47 @@
+/*
+ * ModerationFilter class declaration
+ */
+
+// Banned words and phrases, checked on each chat message before it is sent
+// or stored. The rules are compiled to a single automaton (Aho-Corasick as
+// a DFA), run only from the word starts with a pattern prefix (prefilter).
+// Replaced by load() while the messages are checked with the previous one.
+class ModerationFilter {
+public:
+    // By priority, the strongest of the matched rules is the result
+    enum Action : uint8_t {
+        PASS,
+        FLAG,
+        REDACT,
+        REJECT
+    };
+
+private:
+    class Automaton;
+    std::atomic<std::shared_ptr<const Automaton>> m_automaton;
+    // Changed by load(), the threads keep their own reference until then
+    std::atomic<uint64_t> m_generation = 0;
+    struct AutomatonCache;
+    static thread_local AutomatonCache t_cache;
+
+    std::atomic<uint64_t> m_checked = 0;
+    std::atomic<uint64_t> m_flagged = 0;
+    std::atomic<uint64_t> m_redacted = 0;
+    std::atomic<uint64_t> m_rejected = 0;
+
+    ModerationFilter();
+
+public:
+    ~ModerationFilter();
+
+    static ModerationFilter &instance();
+
+    // Compile the rules file ("<reject|redact|flag> <pattern>" lines), empty path
+    // for none. The previous rules are kept on error.
+    bool load(const std::string &path, std::vector<std::string> &report);
+
+    // Redacts the text in place, rule is the (first) pattern of the returned action
+    Action check(std::string &text, std::string &rule);
+
+    std::vector<std::string> get_report();
+};
@@ -0,0 +1,103 @@
+/*
+ * Moderation filter benchmark: messages checked per second, by rule count and
+ * message size (generated English-like words, few of them matched)
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <unistd.h>
+
+#include "moderation.h"
+
+
+// Rules file written to the working directory (removed at the end)
+#define BENCH_RULES_FILE    "moderation_bench.rules"
+// Text checked per message size and round, the best round is reported
+#define BENCH_TEXT_BYTES    (16 << 20)
+#define BENCH_ROUNDS        5
+
+// Letters by English frequency
+static const char s_letters[] = "eeeeeeeeeeeetttttttttaaaaaaaaooooooooiiiiiiinnnnnnnssssssrrrrrrhhhhhhdddddlllllcccuuummmwwffggyyppbbvkjxqz";
+
+static std::string make_word(std::mt19937 &random, size_t min_length, size_t max_length) {
+    std::string word(min_length + random() % (max_length - min_length + 1), ' ');
+    for (auto &c: word) {
+        c = s_letters[random() % (sizeof(s_letters) - 1)];
+    }
+    return word;
+}
+
+// Words and a few phrases, some also matching the longer words ("word*")
+static bool write_rules(size_t count, std::mt19937 &random) {
+    std::ofstream file(BENCH_RULES_FILE);
+    const char *actions[] = {"reject", "redact", "flag"};
+    for (size_t i = 0; i < count; i++) {
+        file << actions[i % 3] << " " << make_word(random, 5, 10);
+        if (i % 10 == 1) {
+            file << " " << make_word(random, 3, 8);
+        }
+        else if (i % 10 == 2) {
+            file << "*";
+        }
+        file << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char **argv) {
+    std::mt19937 random(1);
+    std::string text;
+    while (text.size() < BENCH_TEXT_BYTES) {
+        text += make_word(random, 1, 9);
+        text += random() % 8 ? " " : ", ";
+    }
+
+    std::cout << "Rules  Message  ns/message  GB/s  matched" << std::endl;
+    for (size_t rule_count: {100, 1000}) {
+        std::vector<std::string> report;
+        if (!write_rules(rule_count, random)) {
+            std::cerr << "Can't write " << BENCH_RULES_FILE << std::endl;
+            return 1;
+        }
+        if (!ModerationFilter::instance().load(BENCH_RULES_FILE, report)) {
+            for (const auto &line: report) {
+                std::cerr << line << std::endl;
+            }
+            return 1;
+        }
+
+        for (size_t message_size: {64, 256, 1024}) {
+            std::vector<std::string> messages;
+            for (size_t offset = 0; offset + message_size <= text.size(); offset += message_size) {
+                messages.push_back(text.substr(offset, message_size));
+            }
+
+            double best_ns = 0;
+            size_t matched = 0;
+            for (int round = 0; round < BENCH_ROUNDS; round++) {
+                // Redaction changes the text, each round checks copies
+                auto checked = messages;
+                std::string rule;
+                matched = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (auto &message: checked) {
+                    matched += ModerationFilter::instance().check(message, rule) != ModerationFilter::PASS;
+                }
+                double ns = std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - start).count() / messages.size();
+                best_ns = round ? std::min(best_ns, ns) : ns;
+            }
+            std::cout << std::format("{:5} {:6} B {:11.0f} {:5.2f} {:8}", rule_count, message_size,
+                    best_ns, message_size / best_ns, matched) << std::endl;
+        }
+    }
+    unlink(BENCH_RULES_FILE);
+    return 0;
+}
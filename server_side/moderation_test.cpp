@@ -0,0 +1,146 @@
+/*
+ * Moderation filter test: the automaton with the prefilter against a naive
+ * search of each pattern, over random rule sets and messages
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <format>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "moderation.h"
+
+
+// Rules file written to the working directory (removed at the end)
+#define TEST_RULES_FILE     "moderation_test.rules"
+#define TEST_RULE_SETS      100
+#define TEST_MESSAGES       2000
+// Longer than a prefilter block (64 bytes)
+#define TEST_MAX_MESSAGE    300
+// Mismatches printed
+#define TEST_MAX_ERRORS     5
+
+struct Rule {
+    ModerationFilter::Action action;
+    // Lower case, without the '*'
+    std::string pattern;
+    bool is_open_start;
+    bool is_open_end;
+};
+
+// Few letters (many matches), punctuation and a UTF-8 lead byte
+static const char s_pattern_chars[] = "abcAB-$\xc3";
+static const char s_text_chars[] = "abcAB-$\xc3\xa9 ,.";
+
+static std::string make_word(std::mt19937 &random, size_t length, const char *chars, size_t count) {
+    std::string word;
+    for (size_t i = 0; i < length; i++) {
+        word += chars[random() % count];
+    }
+    return word;
+}
+
+static std::string to_lower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) {
+        return c < 0x80 ? static_cast<char>(std::tolower(c)) : static_cast<char>(c);
+    });
+    return text;
+}
+
+static bool is_word_byte(unsigned char c) {
+    return std::isalnum(c) || c >= 0x80;
+}
+
+// Every occurrence of every pattern, at the word boundaries unless open
+static ModerationFilter::Action reference_check(std::string &text, const std::vector<Rule> &rules) {
+    // Boundaries of the original text, not of the redacted
+    const auto original = text;
+    auto lower = to_lower(text);
+    auto action = ModerationFilter::PASS;
+    for (const auto &rule: rules) {
+        for (size_t pos = lower.find(rule.pattern); pos != std::string::npos; pos = lower.find(rule.pattern, pos + 1)) {
+            size_t end = pos + rule.pattern.size();
+            if ((rule.is_open_start || pos == 0 || !is_word_byte(original[pos - 1])) &&
+                    (rule.is_open_end || end == text.size() || !is_word_byte(original[end]))) {
+                action = std::max(action, rule.action);
+                if (rule.action == ModerationFilter::REDACT) {
+                    std::fill(text.begin() + pos, text.begin() + end, '*');
+                }
+            }
+        }
+    }
+    return action;
+}
+
+// Short, open-start, open-end, punctuation-initial and phrase patterns
+static std::vector<Rule> write_rules(std::mt19937 &random) {
+    bool is_short = random() % 2, is_open_start = random() % 2, is_punctuation = random() % 2;
+    std::vector<Rule> rules(1 + random() % 40);
+    std::ofstream file(TEST_RULES_FILE);
+    for (auto &rule: rules) {
+        rule.action = static_cast<ModerationFilter::Action>(1 + random() % 3);
+        auto pattern = make_word(random, (is_short ? 1 : 4) + random() % 6, s_pattern_chars, 3);
+        if (is_punctuation && random() % 5 == 0) {
+            pattern[0] = "-$"[random() % 2];
+        }
+        if (random() % 6 == 0) {
+            pattern += " " + make_word(random, 1 + random() % 3, s_pattern_chars, 3);
+        }
+        rule.pattern = to_lower(pattern);
+        rule.is_open_start = is_open_start && random() % 4 == 0;
+        rule.is_open_end = random() % 4 == 0;
+
+        const char *actions[] = {"", "flag", "redact", "reject"};
+        file << actions[rule.action] << " " << (rule.is_open_start ? "*" : "") << pattern <<
+                (rule.is_open_end ? "*" : "") << "\n";
+    }
+    return rules;
+}
+
+int main(int argc, char **argv) {
+    // Optional seed argument
+    std::mt19937 random(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1);
+    size_t checked = 0, errors = 0;
+    for (int set = 0; set < TEST_RULE_SETS; set++) {
+        auto rules = write_rules(random);
+        std::vector<std::string> report;
+        if (!ModerationFilter::instance().load(TEST_RULES_FILE, report)) {
+            for (const auto &line: report) {
+                std::cerr << line << std::endl;
+            }
+            return 1;
+        }
+
+        for (int i = 0; i < TEST_MESSAGES; i++) {
+            std::string text;
+            size_t length = random() % TEST_MAX_MESSAGE;
+            while (text.size() < length) {
+                text += make_word(random, 1 + random() % 6, s_text_chars, sizeof(s_text_chars) - 1);
+            }
+
+            auto expected_text = text, checked_text = text;
+            std::string rule;
+            auto expected = reference_check(expected_text, rules);
+            auto action = ModerationFilter::instance().check(checked_text, rule);
+            checked++;
+            // A rejected message is not redacted (dropped)
+            if (action != expected || (expected != ModerationFilter::REJECT && checked_text != expected_text)) {
+                if (errors++ < TEST_MAX_ERRORS) {
+                    std::cerr << std::format("Rule set {}: \"{}\" is {}, expected {} (\"{}\", expected \"{}\")",
+                            set, text, static_cast<int>(action), static_cast<int>(expected),
+                            checked_text, expected_text) << std::endl;
+                }
+            }
+        }
+    }
+    unlink(TEST_RULES_FILE);
+
+    std::cout << std::format("{} messages checked, {} mismatches", checked, errors) << std::endl;
+    return errors ? 1 : 0;
+}
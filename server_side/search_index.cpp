@@ -0,0 +1,214 @@
+/*
+ * SearchIndex class implementation
+ */
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cctype>
+#include <cstring>
+
+#include "search_index.h"
+
+
+/*
+ * Saved index layout (host byte order):
+ *  u64 term count
+ *  SavedTerm entries, in term byte order (binary searched)
+ *  term and posting list bytes, at the offsets of the entries
+ */
+#pragma pack(push, 1)
+struct SavedTerm {
+    // From the start of the saved index
+    uint64_t term_offset;
+    uint64_t list_offset;
+    uint32_t term_len;
+    uint32_t list_len;
+    uint32_t count;
+};
+#pragma pack(pop)
+
+static std::vector<uint32_t> decode(std::string_view deltas, uint32_t count) {
+    std::vector<uint32_t> result;
+    result.reserve(count);
+
+    uint32_t value = 0, delta = 0;
+    int shift = 0;
+    for (char c: deltas) {
+        delta |= static_cast<uint32_t>(c & 0x7F) << shift;
+        if (c & 0x80) {
+            shift += 7;
+            continue;
+        }
+        value += delta;
+        result.push_back(value);
+        delta = 0;
+        shift = 0;
+    }
+    return result;
+}
+
+// Pairs of the posting list bytes and count, the result is ascending
+static std::vector<uint32_t> intersect(std::vector<std::pair<std::string_view, uint32_t>> lists) {
+    if (lists.empty()) {
+        return {};
+    }
+    // Start from the shortest list, the intersection can only shrink
+    std::sort(lists.begin(), lists.end(), [](const auto &a, const auto &b) { return a.second < b.second; });
+    auto result = decode(lists[0].first, lists[0].second);
+    for (size_t i = 1; i < lists.size() && result.size(); i++) {
+        auto other = decode(lists[i].first, lists[i].second);
+        std::vector<uint32_t> common;
+        std::set_intersection(result.begin(), result.end(), other.begin(), other.end(),
+                std::back_inserter(common));
+        result.swap(common);
+    }
+    return result;
+}
+
+// Entry number i of a saved index, false when out of the data
+static bool read_saved_term(std::string_view data, uint64_t i, SavedTerm &entry) {
+    memcpy(&entry, data.data() + sizeof(uint64_t) + i * sizeof(entry), sizeof(entry));
+    return entry.term_offset <= data.size() && entry.term_len <= data.size() - entry.term_offset &&
+            entry.list_offset <= data.size() && entry.list_len <= data.size() - entry.list_offset;
+}
+
+void SearchIndex::PostingList::append(uint32_t msg_num) {
+    if (count && msg_num == last) {
+        return;     // Already there
+    }
+    // LEB128 varint of the delta to the previous number
+    uint32_t delta = count ? msg_num - last : msg_num;
+    while (delta >= 0x80) {
+        deltas.push_back(static_cast<char>(delta | 0x80));
+        delta >>= 7;
+    }
+    deltas.push_back(static_cast<char>(delta));
+    last = msg_num;
+    count++;
+}
+
+std::vector<uint32_t> SearchIndex::PostingList::decode() const {
+    return ::decode(deltas, count);
+}
+
+std::vector<std::string> SearchIndex::tokenize(std::string_view text) {
+    std::vector<std::string> tokens;
+    std::string token;
+    for (size_t i = 0; i <= text.size(); i++) {
+        unsigned char c = i < text.size() ? text[i] : ' ';
+        // Non-ASCII (UTF-8) bytes are kept as part of the word
+        if (std::isalnum(c) || c >= 0x80) {
+            token.push_back(std::tolower(c));
+        }
+        else if (token.size()) {
+            tokens.push_back(std::move(token));
+            token.clear();
+        }
+    }
+
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+    return tokens;
+}
+
+std::string SearchIndex::user_term(std::string_view user_name) {
+    // Can't collide with the words, these have no punctuation
+    return "@" + std::string(user_name);
+}
+
+void SearchIndex::add(uint32_t msg_num, std::string_view user_name, std::string_view text) {
+    for (const auto &token: tokenize(text)) {
+        m_terms[token].append(msg_num);
+    }
+    m_terms[user_term(user_name)].append(msg_num);
+}
+
+std::vector<uint32_t> SearchIndex::find_all(const std::vector<std::string> &terms) const {
+    std::vector<std::pair<std::string_view, uint32_t>> lists;
+    for (const auto &term: terms) {
+        auto it = m_terms.find(term);
+        if (it == m_terms.end()) {
+            return {};
+        }
+        lists.emplace_back(it->second.deltas, it->second.count);
+    }
+    return intersect(std::move(lists));
+}
+
+SearchIndex SearchIndex::select(const std::vector<std::string> &terms) const {
+    SearchIndex selected;
+    for (const auto &term: terms) {
+        auto it = m_terms.find(term);
+        if (it == m_terms.end()) {
+            return {};
+        }
+        selected.m_terms.emplace(term, it->second);
+    }
+    return selected;
+}
+
+void SearchIndex::save(std::string &data) const {
+    std::vector<const std::pair<const std::string, PostingList>*> terms;
+    for (const auto &term: m_terms) {
+        terms.push_back(&term);
+    }
+    std::sort(terms.begin(), terms.end(), [](auto a, auto b) { return a->first < b->first; });
+
+    size_t start = data.size();
+    uint64_t term_count = terms.size();
+    data.append(reinterpret_cast<const char*>(&term_count), sizeof(term_count));
+    size_t entries = data.size();
+    data.resize(entries + terms.size() * sizeof(SavedTerm));
+    for (size_t i = 0; i < terms.size(); i++) {
+        const auto &[term, list] = *terms[i];
+        SavedTerm entry{
+            .term_offset = data.size() - start,
+            .list_offset = data.size() - start + term.size(),
+            .term_len = static_cast<uint32_t>(term.size()),
+            .list_len = static_cast<uint32_t>(list.deltas.size()),
+            .count = list.count,
+        };
+        memcpy(data.data() + entries + i * sizeof(entry), &entry, sizeof(entry));
+        data += term;
+        data += list.deltas;
+    }
+}
+
+std::vector<uint32_t> SearchIndex::find_saved(std::string_view data, const std::vector<std::string> &terms) {
+    uint64_t term_count;
+    if (data.size() < sizeof(term_count)) {
+        return {};
+    }
+    memcpy(&term_count, data.data(), sizeof(term_count));
+    if (term_count > (data.size() - sizeof(term_count)) / sizeof(SavedTerm)) {
+        return {};
+    }
+
+    std::vector<std::pair<std::string_view, uint32_t>> lists;
+    for (const auto &term: terms) {
+        // First entry not less than the term
+        uint64_t low = 0, high = term_count;
+        SavedTerm entry;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (!read_saved_term(data, middle, entry)) {
+                return {};
+            }
+            if (data.substr(entry.term_offset, entry.term_len) < term) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        if (low == term_count || !read_saved_term(data, low, entry) ||
+                data.substr(entry.term_offset, entry.term_len) != term) {
+            return {};
+        }
+        lists.emplace_back(data.substr(entry.list_offset, entry.list_len), entry.count);
+    }
+    return intersect(std::move(lists));
+}
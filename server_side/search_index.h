@@ -0,0 +1,39 @@
+/*
+ * SearchIndex class declaration
+ */
+
+// Inverted index of a message store segment: term to the list of messages
+// (segment local numbers), which contain it
+class SearchIndex {
+    // Ascending message numbers, delta + varint compressed
+    struct PostingList {
+        std::string deltas;
+        uint32_t last = 0;
+        uint32_t count = 0;
+
+        void append(uint32_t msg_num);
+        std::vector<uint32_t> decode() const;
+    };
+    std::unordered_map<std::string, PostingList> m_terms;
+
+public:
+    // Unique lower-case words from a text
+    static std::vector<std::string> tokenize(std::string_view text);
+    // Pseudo-term to filter by message author
+    static std::string user_term(std::string_view user_name);
+
+    // Message numbers must be added in ascending order
+    void add(uint32_t msg_num, std::string_view user_name, std::string_view text);
+    // Message numbers containing all the terms, ascending
+    std::vector<uint32_t> find_all(const std::vector<std::string> &terms) const;
+    // Copy of only the terms (none when one is missing), for find_all without a lock
+    SearchIndex select(const std::vector<std::string> &terms) const;
+
+    // Appends the index to data, in the form searched by find_saved
+    void save(std::string &data) const;
+    // find_all in a saved index, in place (a mapped file): only the lists of
+    // the terms are read, damaged entries are not found
+    static std::vector<uint32_t> find_saved(std::string_view data, const std::vector<std::string> &terms);
+
+    size_t get_term_count() const { return m_terms.size(); }
+};
@@ -0,0 +1,132 @@
+/*
+ * Search index test: tokenizing, posting list round trip, intersection, and
+ * the saved index against the in-memory one
+ */
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <format>
+#include <vector>
+#include <unordered_map>
+#include <set>
+#include <random>
+#include <cstdlib>
+
+#include "search_index.h"
+
+
+#define TEST_MESSAGES       5000
+#define TEST_WORDS          50
+#define TEST_QUERIES        2000
+
+static int s_errors = 0;
+
+static void check(bool is_ok, const std::string &what) {
+    if (!is_ok) {
+        std::cerr << "Failed: " << what << std::endl;
+        s_errors++;
+    }
+}
+
+static std::string join(const std::vector<std::string> &tokens) {
+    std::string text;
+    for (const auto &token: tokens) {
+        text += (text.empty() ? "" : ",") + token;
+    }
+    return text;
+}
+
+static void check_tokenize(std::string_view text, const std::vector<std::string> &expected) {
+    auto tokens = SearchIndex::tokenize(text);
+    check(tokens == expected, std::format("tokenize(\"{}\") is {}", text, join(tokens)));
+}
+
+// The in-memory and the saved index give the same
+static std::vector<uint32_t> find_both(const SearchIndex &index, const std::string &saved,
+        const std::vector<std::string> &terms) {
+    auto found = index.find_all(terms);
+    check(SearchIndex::find_saved(saved, terms) == found, std::format("find_saved({})", join(terms)));
+    return found;
+}
+
+int main(int argc, char **argv) {
+    // Lower case, unique and sorted, UTF-8 bytes are part of the word
+    check_tokenize("Hello, WORLD! hello", {"hello", "world"});
+    check_tokenize("a-b_c.d", {"a", "b", "c", "d"});
+    check_tokenize("abc123 123", {"123", "abc123"});
+    check_tokenize("Caf\xc3\xa9 caf\xc3\xa9!", {"caf\xc3\xa9"});
+    check_tokenize("@bob", {"bob"});
+    check_tokenize("", {});
+    check_tokenize(" ,.! ", {});
+    check(SearchIndex::user_term("bob") == "@bob", "user_term");
+
+    // Varint boundaries and large deltas, a repeated number is ignored
+    const std::vector<uint32_t> numbers = {0, 1, 127, 128, 16383, 16384, (1u << 28) - 1, 1u << 28,
+            UINT32_MAX - 1, UINT32_MAX};
+    SearchIndex index;
+    for (auto number: numbers) {
+        index.add(number, "alice", "varint");
+    }
+    index.add(UINT32_MAX, "alice", "varint");
+    std::string saved;
+    index.save(saved);
+    check(find_both(index, saved, {"varint"}) == numbers, "posting list round trip");
+    check(find_both(index, saved, {"varint", SearchIndex::user_term("alice")}) == numbers, "user filter");
+    check(find_both(index, saved, {"varint", SearchIndex::user_term("bob")}).empty(), "other user");
+    check(find_both(index, saved, {"varint", "missing"}).empty(), "missing term");
+    check(find_both(index, saved, {}).empty(), "no terms");
+    check(SearchIndex::find_saved("", {"varint"}).empty(), "empty saved index");
+
+    // Every word list against a naive search, in memory, selected and saved
+    std::mt19937 random(argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1);
+    std::unordered_map<std::string, std::set<uint32_t>> expected;
+    SearchIndex words;
+    for (uint32_t msg_num = 0; msg_num < TEST_MESSAGES; msg_num++) {
+        // Gaps in the numbers, like the retention leaves
+        if (random() % 4 == 0) {
+            continue;
+        }
+        std::string text, user_name = std::format("user{}", random() % 5);
+        for (size_t i = random() % 8; i > 0; i--) {
+            auto word = std::format("w{}", random() % TEST_WORDS);
+            expected[word].insert(msg_num);
+            text += (random() % 2 ? " " : ", ") + word;
+        }
+        expected[SearchIndex::user_term(user_name)].insert(msg_num);
+        words.add(msg_num, user_name, text);
+    }
+    check(words.get_term_count() == expected.size(), "term count");
+    saved.clear();
+    words.save(saved);
+
+    for (int query = 0; query < TEST_QUERIES; query++) {
+        std::vector<std::string> terms;
+        for (size_t i = 1 + random() % 3; i > 0; i--) {
+            // Some words are in no message
+            terms.push_back(random() % 4 ? std::format("w{}", random() % (TEST_WORDS + 5)) :
+                    SearchIndex::user_term(std::format("user{}", random() % 6)));
+        }
+        std::set<uint32_t> common;
+        for (size_t i = 0; i < terms.size(); i++) {
+            const auto &messages = expected[terms[i]];
+            if (i == 0) {
+                common = messages;
+            }
+            else {
+                std::erase_if(common, [&](uint32_t msg_num) { return !messages.count(msg_num); });
+            }
+        }
+        auto found = find_both(words, saved, terms);
+        check(found == std::vector<uint32_t>(common.begin(), common.end()), std::format("find_all({})", join(terms)));
+        check(words.select(terms).find_all(terms) == found, std::format("select({})", join(terms)));
+    }
+
+    // Cut saved data: nothing or the same is found, never out of the data
+    for (size_t size = 0; size < saved.size(); size += 1 + random() % 97) {
+        auto found = SearchIndex::find_saved(std::string_view(saved).substr(0, size), {"w1"});
+        check(found.empty() || found == words.find_all({"w1"}), std::format("saved index cut at {}", size));
+    }
+
+    std::cout << std::format("Search index: {} errors", s_errors) << std::endl;
+    return s_errors ? 1 : 0;
+}
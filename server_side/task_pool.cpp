@@ -0,0 +1,169 @@
+/*
+ * TaskPool class implementation
+ */
+#include <string>
+#include <format>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <array>
+#include <map>
+
+#include "task_pool.h"
+#include "config.h"
+
+
+// Index of the worker running in current thread, -1 for non-worker threads
+static thread_local int t_worker_idx = -1;
+
+static void update_max(std::atomic<uint64_t> &max_value, uint64_t value) {
+    uint64_t prev = max_value;
+    while (prev < value && !max_value.compare_exchange_weak(prev, value)) {
+    }
+}
+
+std::string TaskStats::format() const {
+    uint64_t n = count ? count.load() : 1;
+    return std::format("{}: {} tasks, {} rejected, wait avg {} max {} usec, run avg {} max {} usec",
+            name, count.load(), rejected.load(),
+            wait_ns / n / 1000, max_wait_ns / 1000,
+            run_ns / n / 1000, max_run_ns / 1000);
+}
+
+TaskPool::TaskPool(size_t threads, size_t queue_limit) : m_queue_limit(queue_limit) {
+    for (size_t i = 0; i < threads; i++) {
+        m_workers.push_back(std::make_unique<Worker>());
+    }
+    // Start threads after all the queues are in place (stealing)
+    for (size_t i = 0; i < threads; i++) {
+        m_workers[i]->thread = std::thread(&TaskPool::worker_loop, this, i);
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+        m_stopping = true;
+    }
+    m_idle_cond.notify_all();
+    for (auto &worker: m_workers) {
+        worker->thread.join();
+    }
+}
+
+TaskPool &TaskPool::instance() {
+    // Function static singleton for lazy initialization
+    size_t threads = Config::get(Config::task_threads);
+    static TaskPool pool(threads ? threads : std::max(std::thread::hardware_concurrency(), 2u),
+            Config::get(Config::task_queue_limit));
+    return pool;
+}
+
+TaskStats &TaskPool::get_stats(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    for (auto &stats: m_stats) {
+        if (stats.name == name) {
+            return stats;
+        }
+    }
+    return m_stats.emplace_back(name);
+}
+
+bool TaskPool::submit(TaskStats &stats, Task task) {
+    // Prefer own queue when submitted from a worker, otherwise round-robin
+    size_t first = t_worker_idx >= 0 ? t_worker_idx : m_next_worker++;
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        auto &worker = *m_workers[(first + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.queue.size() < m_queue_limit) {
+            worker.queue.push_back(Item{&stats, std::move(task), Clock::now()});
+            m_queued++;
+            break;
+        }
+        if (i + 1 == m_workers.size()) {
+            // All queues are full
+            stats.rejected++;
+            return false;
+        }
+    }
+
+    {
+        // Guard against lost wake-up of a worker, going to sleep right now
+        std::lock_guard<std::mutex> lock(m_idle_mutex);
+    }
+    m_idle_cond.notify_one();
+    return true;
+}
+
+void TaskPool::wait_idle() {
+    // Rare (upgrade), polling keeps the workers free of any extra signaling
+    while (m_queued || m_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+bool TaskPool::pop_task(size_t worker_idx, Item &item) {
+    // Own queue first, then steal the oldest task from the others
+    for (size_t i = 0; i < m_workers.size(); i++) {
+        auto &worker = *m_workers[(worker_idx + i) % m_workers.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.queue.size()) {
+            item = std::move(worker.queue.front());
+            worker.queue.pop_front();
+            // Running before not queued: wait_idle() sees at least one of them
+            m_running++;
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::worker_loop(size_t worker_idx) {
+    t_worker_idx = worker_idx;
+
+    while (true) {
+        Item item;
+        if (!pop_task(worker_idx, item)) {
+            std::unique_lock<std::mutex> lock(m_idle_mutex);
+            if (m_stopping) {
+                break;
+            }
+            m_idle_cond.wait(lock, [this] { return m_queued > 0 || m_stopping; });
+            continue;
+        }
+
+        auto started_at = Clock::now();
+        item.task();
+        auto done_at = Clock::now();
+        m_running--;
+
+        uint64_t wait_ns = std::chrono::nanoseconds(started_at - item.queued_at).count();
+        uint64_t run_ns = std::chrono::nanoseconds(done_at - started_at).count();
+        TaskStats &stats = *item.stats;
+        stats.count++;
+        stats.wait_ns += wait_ns;
+        stats.run_ns += run_ns;
+        update_max(stats.max_wait_ns, wait_ns);
+        update_max(stats.max_run_ns, run_ns);
+    }
+}
+
+std::vector<std::string> TaskPool::get_report() {
+    std::vector<std::string> report;
+    report.push_back(std::format("{} threads, {} queued tasks (limit {} per thread)",
+            m_workers.size(), m_queued.load(), m_queue_limit));
+
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    for (const auto &stats: m_stats) {
+        report.push_back(stats.format());
+    }
+    return report;
+}
@@ -0,0 +1,72 @@
+/*
+ * TaskPool class declaration
+ */
+
+// Latency metrics for a task category, updated without locking
+struct TaskStats {
+    std::string name;
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> rejected = 0;
+    std::atomic<uint64_t> wait_ns = 0;
+    std::atomic<uint64_t> max_wait_ns = 0;
+    std::atomic<uint64_t> run_ns = 0;
+    std::atomic<uint64_t> max_run_ns = 0;
+
+    TaskStats(const std::string &name) : name(name) {}
+    std::string format() const;
+};
+
+class TaskPool {
+public:
+    using Task = std::function<void()>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Item {
+        TaskStats *stats;
+        Task task;
+        Clock::time_point queued_at;
+    };
+    // Each worker owns a bounded queue, idle workers steal from the others
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Item> queue;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<size_t> m_queue_limit;
+    std::atomic<size_t> m_next_worker = 0;
+    std::atomic<size_t> m_queued = 0;
+    // Taken from the queues, not completed yet
+    std::atomic<size_t> m_running = 0;
+    bool m_stopping = false;
+    std::mutex m_idle_mutex;
+    std::condition_variable m_idle_cond;
+
+    // Stable storage, TaskStats references are kept by the callers
+    std::list<TaskStats> m_stats;
+    std::mutex m_stats_mutex;
+
+    TaskPool(size_t threads, size_t queue_limit);
+
+    bool pop_task(size_t worker_idx, Item &item);
+    void worker_loop(size_t worker_idx);
+
+public:
+    ~TaskPool();
+
+    static TaskPool &instance();
+
+    // Get or create the metrics for a task category (keep the reference)
+    TaskStats &get_stats(const std::string &name);
+
+    // Queue a task, fails when the queue is full (caller decides what to do)
+    bool submit(TaskStats &stats, Task task);
+    // Wait until all the queued tasks are completed (no new ones are expected)
+    void wait_idle();
+
+    size_t get_thread_count() const { return m_workers.size(); }
+    void set_queue_limit(size_t limit) { m_queue_limit = limit; }
+    std::vector<std::string> get_report();
+};
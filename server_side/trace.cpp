@@ -0,0 +1,210 @@
+/*
+ * Tracer class implementation
+ */
+#include <iostream>
+#include <string>
+#include <format>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <array>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "trace.h"
+
+
+// Events kept per thread, the oldest are overwritten
+#define TRACE_BUFFER_EVENTS     4096
+// Dump file is written by this size
+#define TRACE_WRITE_CHUNK       (64 * 1024)
+
+struct Tracer::Event {
+    const char *name;
+    uint64_t trace_id;
+    int64_t begin_ns;
+    int64_t duration_ns;
+    uint32_t tid;
+};
+
+// Event in the buffer, copied by the dump while the owner thread may overwrite it
+// (seqlock): seq is the event number + 1 when written, zero while being written
+struct Tracer::Slot {
+    std::atomic<uint64_t> seq = 0;
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> trace_id;
+    std::atomic<int64_t> begin_ns;
+    std::atomic<int64_t> duration_ns;
+    std::atomic<uint32_t> tid;
+};
+
+// Single writer (owner thread), the dump validates each copied slot by its seq
+struct Tracer::Buffer {
+    std::array<Slot, TRACE_BUFFER_EVENTS> slots;
+    // Count of events ever written
+    std::atomic<uint64_t> head = 0;
+};
+
+// Thread's buffer, taken on the first traced event, given back on thread exit
+class Tracer::BufferHolder {
+public:
+    Buffer *buffer = nullptr;
+    uint32_t tid = 0;
+
+    ~BufferHolder() {
+        if (buffer) {
+            Tracer::instance().release_buffer(buffer);
+        }
+    }
+};
+
+thread_local Tracer::BufferHolder Tracer::t_buffer;
+
+Tracer::Tracer() : m_start(Clock::now()) {
+}
+
+Tracer::~Tracer() {
+}
+
+Tracer &Tracer::instance() {
+    // Never destroyed: buffers are given back by exiting threads, even at exit
+    static Tracer *tracer = new Tracer;
+    return *tracer;
+}
+
+Tracer::Buffer *Tracer::acquire_buffer() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_free_buffers.size()) {
+        auto buffer = m_free_buffers.back();
+        m_free_buffers.pop_back();
+        return buffer;
+    }
+    return m_buffers.emplace_back(std::make_unique<Buffer>()).get();
+}
+
+void Tracer::release_buffer(Buffer *buffer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free_buffers.push_back(buffer);
+}
+
+void Tracer::sample_message() {
+    uint32_t every = m_sample_every.load(std::memory_order_relaxed);
+    if (every == 0) {
+        t_trace_id = 0;
+        return;
+    }
+    bool is_sampled = m_message_count.fetch_add(1, std::memory_order_relaxed) % every == 0;
+    t_trace_id = is_sampled ? ++m_last_trace_id : 0;
+}
+
+void Tracer::record(const char *name, uint64_t trace_id, Clock::time_point begin, Clock::time_point end) {
+    if (t_buffer.buffer == nullptr) {
+        t_buffer.buffer = acquire_buffer();
+        t_buffer.tid = gettid();
+    }
+
+    auto &buffer = *t_buffer.buffer;
+    uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    auto &slot = buffer.slots[head % TRACE_BUFFER_EVENTS];
+    // Invalidate the slot before its fields change
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.trace_id.store(trace_id, std::memory_order_relaxed);
+    slot.begin_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            begin - m_start).count(), std::memory_order_relaxed);
+    slot.duration_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            end - begin).count(), std::memory_order_relaxed);
+    slot.tid.store(t_buffer.tid, std::memory_order_relaxed);
+    slot.seq.store(head + 1, std::memory_order_release);
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+bool Tracer::dump(const std::string &path, size_t &count) {
+    // Copy the events, drop those overwritten (or being written) meanwhile
+    std::vector<Event> events;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto &buffer: m_buffers) {
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t first = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+            for (uint64_t i = first; i < head; i++) {
+                auto &slot = buffer->slots[i % TRACE_BUFFER_EVENTS];
+                if (slot.seq.load(std::memory_order_acquire) != i + 1) {
+                    continue;
+                }
+                Event event{slot.name.load(std::memory_order_relaxed),
+                        slot.trace_id.load(std::memory_order_relaxed),
+                        slot.begin_ns.load(std::memory_order_relaxed),
+                        slot.duration_ns.load(std::memory_order_relaxed),
+                        slot.tid.load(std::memory_order_relaxed)};
+                // Still the same event after the copy
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.seq.load(std::memory_order_relaxed) == i + 1) {
+                    events.push_back(event);
+                }
+            }
+        }
+    }
+    std::sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+        return a.trace_id != b.trace_id ? a.trace_id < b.trace_id : a.begin_ns < b.begin_ns;
+    });
+
+    // Exclusive create: never follows a link or truncates an existing file
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Can't create " << path << ", error " << errno << std::endl;
+        return false;
+    }
+    // Written in chunks
+    std::string file = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    auto write_file = [fd, &file] {
+        for (size_t written = 0; written < file.size(); ) {
+            ssize_t bytes = write(fd, file.data() + written, file.size() - written);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += bytes;
+        }
+        file.clear();
+        return true;
+    };
+    bool is_written = true;
+    for (size_t i = 0; i < events.size() && is_written; i++) {
+        const auto &event = events[i];
+        double ts = event.begin_ns / 1000.0;
+        file += std::format("{}\n{{\"name\":\"{}\",\"cat\":\"message\",\"ph\":\"X\",\"ts\":{:.3f},"
+                "\"dur\":{:.3f},\"pid\":1,\"tid\":{},\"args\":{{\"trace_id\":{}}}}}",
+                i ? "," : "", event.name, ts, event.duration_ns / 1000.0, event.tid, event.trace_id);
+
+        // Flow arrows between the stages of the same message
+        bool is_first = i == 0 || events[i - 1].trace_id != event.trace_id;
+        bool is_last = i + 1 == events.size() || events[i + 1].trace_id != event.trace_id;
+        if (!(is_first && is_last)) {
+            file += std::format(",\n{{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"{}\",\"id\":{},"
+                    "\"ts\":{:.3f},\"pid\":1,\"tid\":{}{}}}",
+                    is_first ? "s" : is_last ? "f" : "t", event.trace_id, ts, event.tid,
+                    is_last ? ",\"bp\":\"e\"" : "");
+        }
+        if (file.size() >= TRACE_WRITE_CHUNK) {
+            is_written = write_file();
+        }
+    }
+    file += "\n]}\n";
+    is_written = is_written && write_file();
+    close(fd);
+    if (!is_written) {
+        std::cerr << "Can't write " << path << ", error " << errno << std::endl;
+        unlink(path.c_str());
+        return false;
+    }
+    count = events.size();
+    return true;
+}
@@ -0,0 +1,83 @@
+/*
+ * Tracer class declaration
+ */
+
+// Sampled per-message tracing: the stages of a traced message are recorded
+// to per-thread buffers (lock-free), dumped as Chrome trace-event JSON
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Id of the message traced by the current thread, zero when not sampled
+    inline static thread_local uint64_t t_trace_id = 0;
+
+private:
+    struct Event;
+    struct Slot;
+    struct Buffer;
+    class BufferHolder;
+    static thread_local BufferHolder t_buffer;
+
+    // Buffers are reused by new threads, their events are kept
+    std::vector<std::unique_ptr<Buffer>> m_buffers;
+    std::vector<Buffer*> m_free_buffers;
+    std::mutex m_mutex;
+
+    std::atomic<uint32_t> m_sample_every = 0;
+    std::atomic<uint64_t> m_message_count = 0;
+    std::atomic<uint64_t> m_last_trace_id = 0;
+    const Clock::time_point m_start;
+
+    Tracer();
+
+    Buffer *acquire_buffer();
+    void release_buffer(Buffer *buffer);
+
+public:
+    ~Tracer();
+
+    static Tracer &instance();
+
+    // Trace one of every messages, zero is off
+    void set_sampling(uint32_t every) { m_sample_every = every; }
+    // Set t_trace_id for the next message received by this thread
+    void sample_message();
+
+    void record(const char *name, uint64_t trace_id, Clock::time_point begin, Clock::time_point end);
+
+    // Write the recorded events to a new file (an existing one is not overwritten)
+    bool dump(const std::string &path, size_t &count);
+};
+
+// Traced stage of the current message, only a thread-local check when not sampled
+class TraceScope {
+    const char *m_name;
+    uint64_t m_trace_id;
+    Tracer::Clock::time_point m_begin;
+
+public:
+    TraceScope(const char *name) : m_name(name), m_trace_id(Tracer::t_trace_id) {
+        if (m_trace_id) {
+            m_begin = Tracer::Clock::now();
+        }
+    }
+    ~TraceScope() {
+        if (m_trace_id) {
+            Tracer::instance().record(m_name, m_trace_id, m_begin, Tracer::Clock::now());
+        }
+    }
+};
+
+// Continue the trace in another thread (like a task for the traced message)
+class TraceContext {
+    uint64_t m_prev_id;
+
+public:
+    TraceContext(uint64_t trace_id) : m_prev_id(Tracer::t_trace_id) { Tracer::t_trace_id = trace_id; }
+    ~TraceContext() { Tracer::t_trace_id = m_prev_id; }
+};
+
+#define TRACE_CONCAT_(a, b)     a##b
+#define TRACE_CONCAT(a, b)      TRACE_CONCAT_(a, b)
+// Name must be a string literal (kept by pointer)
+#define TRACE_SCOPE(name)       TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -3,9 +3,25 @@
 #include <format>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <memory>
+#include <shared_mutex>
+#include <unordered_map>
 #include <map>
+#include <array>
+#include <vector>
+#include <deque>
+#include <list>
+#include <functional>
+#include <atomic>
+#include <random>
+#include <algorithm>
 #include "user_data.h"
+#include "client_connection.h"
+#include "message_store.h"
+#include "config.h"
+#include "messages.pb.h"
 
 
 // Map of user-name to UserData and guard mutex
@@ -13,8 +29,9 @@
 // Note:
 // user_database_mutex can be locked while clients_mutex is locked,
 // esp. in delete user scenario (dead-lock notice).
-std::map<std::string, std::shared_ptr<UserData>> g_user_database;
-std::mutex user_database_mutex;
+// Shared lock for lookups (like each direct message), exclusive to create
+std::unordered_map<std::string, std::shared_ptr<UserData>> g_user_database;
+std::shared_mutex user_database_mutex;
 
 std::shared_ptr<UserData> find_user(const std::string &name, bool do_create) {
     if (name.empty()) {
@@ -22,13 +39,21 @@ std::shared_ptr<UserData> find_user(const std::string &name, bool do_create) {
     }
 
     // Guard access to database
-    std::lock_guard<std::mutex> lock(user_database_mutex);
-    auto it = g_user_database.find(name);
-    if (it != g_user_database.end()) {
-        return it->second;
+    {
+        std::shared_lock<std::shared_mutex> lock(user_database_mutex);
+        auto it = g_user_database.find(name);
+        if (it != g_user_database.end()) {
+            return it->second;
+        }
     }
 
     if (do_create) {
+        std::lock_guard<std::shared_mutex> lock(user_database_mutex);
+        // Could be created meanwhile
+        auto it = g_user_database.find(name);
+        if (it != g_user_database.end()) {
+            return it->second;
+        }
         // Create a new user element in database
         auto user = std::make_shared<UserData>();
         user->construct(name);
@@ -39,9 +64,19 @@ std::shared_ptr<UserData> find_user(const std::string &name, bool do_create) {
     return nullptr;
 }
 
+std::vector<std::shared_ptr<UserData>> get_all_users() {
+    std::shared_lock<std::shared_mutex> lock(user_database_mutex);
+    std::vector<std::shared_ptr<UserData>> users;
+    users.reserve(g_user_database.size());
+    for (const auto &[name, user]: g_user_database) {
+        users.push_back(user);
+    }
+    return users;
+}
+
 bool delete_user(const UserData &user) {
     // Guard access to database
-    std::lock_guard<std::mutex> lock(user_database_mutex);
+    std::lock_guard<std::shared_mutex> lock(user_database_mutex);
     auto it = g_user_database.find(user.get_name());
     if (it != g_user_database.end()) {
         return false;
@@ -56,13 +91,68 @@ UserData::UserData() {
 
 void UserData::construct(const std::string &name) {
     m_name = name;
+
+    static std::mutex random_mutex;
+    static std::mt19937_64 random_gen{std::random_device{}()};
+    std::lock_guard<std::mutex> lock(random_mutex);
+    m_resume_token = std::format("{:016x}{:016x}", random_gen(), random_gen());
+}
+
+bool UserData::store_chat(uint64_t seq, const TimePoint &sent_at, const std::string &text) {
+    return MessageStore::instance().append(seq, sent_at, m_name, text);
+}
+
+void UserData::add_connection(ClientConnection *connection) {
+    // Under the lock no direct message can get before the inbox ones
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (std::find(m_connections.begin(), m_connections.end(), connection) == m_connections.end()) {
+        m_connections.push_back(connection);
+    }
+    if (m_inbox.size()) {
+        std::string frames;
+        for (const auto &frame: m_inbox) {
+            frames += frame;
+        }
+        m_inbox.clear();
+        connection->send_frames(frames);
+    }
+}
+
+void UserData::remove_connection(ClientConnection *connection) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::erase(m_connections, connection);
+}
+
+size_t UserData::deliver(const std::string &frame) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_connections.empty()) {
+        m_inbox.push_back(frame);
+        while (m_inbox.size() > static_cast<size_t>(Config::get(Config::inbox_size))) {
+            m_inbox.pop_front();
+        }
+        return 0;
+    }
+
+    for (auto connection: m_connections) {
+        connection->send_frames(frame);
+    }
+    return m_connections.size();
+}
+
+void UserData::save_state(PBUpgradeUser &state) {
+    state.set_name(m_name);
+    state.set_is_admin(m_is_admin);
+    state.set_resume_token(m_resume_token);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto &frame: m_inbox) {
+        state.add_inbox(frame);
+    }
 }
 
-bool UserData::store_chat(const TimePoint &sent_at, const std::string &text) {
-#if 0   // TODO: Implement chat storage, now just debug print
-    std::cout << "TODO: Store chat from: " << m_name
-            << std::format(", sent at UTC {:%Y-%m-%d %H:%M:%S}", sent_at)
-            << ", text: " << text << std::endl;
-#endif
-    return false;
+void UserData::restore_state(const PBUpgradeUser &state) {
+    // Sessions of the previous process can be resumed
+    m_is_admin = state.is_admin();
+    m_resume_token = state.resume_token();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inbox.assign(state.inbox().begin(), state.inbox().end());
 }
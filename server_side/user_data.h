@@ -2,10 +2,20 @@
  * UserData class declaration
  */
 
+class ClientConnection;
+class PBUpgradeUser;
 
 class UserData {
     std::string m_name;
     bool m_is_admin = true;
+    // Allows the client to resume the session after connection loss
+    std::string m_resume_token;
+
+    // Logged in connections and the direct messages received while there was none
+    // Note: m_mutex is per user, direct messages never lock clients_mutex
+    std::mutex m_mutex;
+    std::vector<ClientConnection*> m_connections;
+    std::deque<std::string> m_inbox;
 
 public:
     UserData();
@@ -14,9 +24,23 @@ public:
     std::string get_name() const { return m_name;}
     bool is_admin() const { return m_is_admin;}
     bool set_admin(bool is_admin) { m_is_admin = is_admin; return true;}
+    const std::string &get_resume_token() const { return m_resume_token;}
 
     using TimePoint = std::chrono::sys_time<std::chrono::nanoseconds>;
-    bool store_chat(const TimePoint &sent_at, const std::string &text);
+    bool store_chat(uint64_t seq, const TimePoint &sent_at, const std::string &text);
+
+    // Register the connection after its login reply, sends the inbox to it
+    void add_connection(ClientConnection *connection);
+    // Must be called before the connection object is destroyed
+    void remove_connection(ClientConnection *connection);
+    // Send the frame to all the user's connections, or keep it in the inbox
+    // Returns the count of connections sent to, zero when kept in the inbox
+    size_t deliver(const std::string &frame);
+
+    // Zero-downtime upgrade: the state for the new server process and back
+    void save_state(PBUpgradeUser &state);
+    void restore_state(const PBUpgradeUser &state);
 };
 
 std::shared_ptr<UserData> find_user(const std::string &name, bool do_create);
+std::vector<std::shared_ptr<UserData>> get_all_users();